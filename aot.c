@@ -0,0 +1,1055 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "lambda.h"
+
+/* Ahead-of-time compilation of the definitions: the first term that uses one
+ * gets every definition made or loaded so far compiled at once, so a prelude is
+ * compiled once, and later definitions are with the next term using one. Every
+ * lambda and every argument that is not already a variable or a lambda becomes
+ * a C function taking its captured variables in an environment array, and the
+ * lot is built into a shared object with the C compiler and loaded. The rest of
+ * a term is interpreted, so terms don't wait for the compiler but when new
+ * definitions show up.
+ *
+ * Definitions are inlined by the parser, so they are found again as the closed
+ * subterms of a term that are the same as one of them, through a hash of their
+ * tree. The interpreter and the compiled code share the runtime below, which
+ * the objects are handed when they are loaded: values of either kind can be
+ * applied to each other.
+ *
+ * Both run call-by-need: arguments are thunks which are updated with their value
+ * once forced, and an application of a neutral value is just recorded. Read-back
+ * applies lambdas to fresh variables, so the normal form is the one normal order
+ * reduction would find. It comes back packed into words like tpack() does it.
+ * With a budget, every beta step is taken off it through tspend(), and a run that
+ * has to stop leaves the term as it was.
+ *
+ * The C source goes to a directory of its own made by mkdtemp(), where nobody
+ * else can put a shared object in its place, and the compiler is run without a
+ * shell: $CC is split at blanks into the program and its first arguments. A
+ * definition that doesn't compile is interpreted from then on. Loaded objects
+ * stay loaded. */
+#define STACK_SIZE (256UL << 20)
+#define BUCKETS 4096
+
+/* How a function reaches the variables of its body: index i is the argument of
+ * the lambda if slots[i] is PARAM, or else env[slots[i]]. */
+struct scope {
+    unsigned int n;
+    int * slots;
+};
+
+/* Functions are emitted innermost first, with prototypes ahead of all of them. */
+struct emitter {
+    FILE * protos, * defs;
+    unsigned int ids;
+};
+
+#define PARAM (-1)
+
+struct value;
+
+typedef struct value * (*code_t)(struct value **, struct value *);
+
+/* A value: a compiled lambda or thunk has its code and the environment array
+ * the code reads the captured variables from, an interpreted one its node and
+ * its scope, the ENV cells binding its indices from 0 up, each holding a value
+ * in a and the next cell in scope. A thunk keeps its value in a once forced, an
+ * application its operands in a and b. */
+enum {
+    LAM,
+    ILAM,
+    THUNK,
+    ITHUNK,
+    VAR,
+    FREE,
+    APP,
+    ENV
+};
+
+struct value {
+    int tag;
+    char var;
+    unsigned int level;
+    code_t code;
+    struct value ** env;
+    const struct anode * node;
+    struct value * scope, * a, * b;
+};
+
+/* What compiled code calls back into, in the order the objects expect it. */
+struct runtime {
+    struct value * (*closure)(code_t, int, int, ...);
+    struct value * (*thunk)(code_t, int, ...);
+    struct value * (*atom)(int);
+    struct value * (*force)(struct value *);
+    struct value * (*apply)(struct value *, struct value *);
+};
+
+/* The program the interpreter runs is the term in post-order, every node with
+ * its operands by number: a the body or the function, b the argument. A closed
+ * subterm a definition was compiled from becomes a tcompiled node calling the
+ * code of its thunk. */
+enum {
+    tcompiled = tindex + 1
+};
+
+struct anode {
+    int type;
+    unsigned int n, a, b;
+    code_t code;
+};
+
+/* A subterm on its way into the program: the first node of its subtree, and the
+ * hash and loose indices of the left operand of an application. */
+struct aframe {
+    const struct term_t * t;
+    unsigned int start, left, loose, n;
+    unsigned long hash;
+};
+
+/* A closed subterm of the program, which may be a definition. */
+struct candidate {
+    const struct term_t * t;
+    unsigned int node, start;
+    unsigned long hash;
+    struct known * k;
+};
+
+/* A definition, packed the way the terms using it are by the time they are run,
+ * and its code once compiled. */
+struct known {
+    struct known * next;
+    unsigned long hash;
+    unsigned int * words;
+    size_t size;
+    code_t code;
+    bool failed;
+};
+
+/* Definitions to compile, and what compiling them gave, or why that gave up. */
+struct build {
+    struct term_t ** terms;
+    unsigned int n;
+    void * lib;
+    const code_t * defs;
+    bool failed;
+    int failure;
+};
+
+/* A program and what running it gave, within what was left of the budget. */
+struct run {
+    const struct anode * program;
+    unsigned int root;
+    unsigned int * words;
+    size_t n;
+    unsigned long betas, fuel, ms;
+    int result;
+};
+
+/* The heap of a run, which goes as a whole once it is read back. */
+struct block {
+    struct block * next;
+};
+
+/* Work left by read-back: an argument to quote under depth binders. */
+struct job {
+    struct value * v;
+    unsigned int depth;
+};
+
+static void * agrow(void *, unsigned int *, size_t);
+static void * aalloc(size_t);
+static struct value * avalue(int);
+static struct value * awith(int, code_t, int, int, va_list);
+static struct value * aclosure(code_t, int, int, ...);
+static struct value * athunk(code_t, int, ...);
+static struct value * aatom(int);
+static struct value * aforce(struct value *);
+static void aspend(void);
+static struct value * aenter(struct value *, struct value *);
+static struct value * aapply(struct value *, struct value *);
+static struct value * aeval(const struct anode *, struct value *);
+static struct value * adelay(const struct anode *, struct value *);
+static void aput(unsigned int);
+static void aquote(struct value *, unsigned int);
+static unsigned long amix(unsigned int, unsigned long, unsigned long);
+static unsigned long ahash(const unsigned int *, size_t);
+static void aknow(unsigned int *, unsigned int, void *);
+static void arefresh(void);
+static unsigned int anew(int, unsigned int, unsigned int, unsigned int);
+static unsigned int aprogram(const struct term_t *);
+static void alink(void);
+static void acapture(const struct term_t *, unsigned int, unsigned char *, unsigned int);
+static void afunction(const struct term_t *, bool, const struct scope *, FILE *, struct emitter *);
+static void aref(const struct scope *, unsigned int, FILE *);
+static void aexpr(const struct term_t *, const struct scope *, FILE *, struct emitter *);
+static void aarg(const struct term_t *, const struct scope *, FILE *, struct emitter *);
+static bool acc(const char *, const char *);
+static bool acompile(struct term_t **, unsigned int, const char *, const char *);
+static void * aload(struct term_t **, unsigned int);
+static void * abuild(void *);
+static void * arun(void *);
+static void abig(void * (*)(void *), void *);
+
+static const char interface[] =
+    "typedef struct V V;\n"
+    "struct runtime {\n"
+    "    V * (*closure)(V * (*)(V **, V *), int, int, ...);\n"
+    "    V * (*thunk)(V * (*)(V **, V *), int, ...);\n"
+    "    V * (*atom)(int);\n"
+    "    V * (*force)(V *);\n"
+    "    V * (*apply)(V *, V *);\n"
+    "};\n"
+    "static const struct runtime * rt;\n"
+    "#define closure (*rt->closure)\n"
+    "#define thunk (*rt->thunk)\n"
+    "#define atom (*rt->atom)\n"
+    "#define force (*rt->force)\n"
+    "#define apply (*rt->apply)\n"
+    "void lambda_link(const struct runtime * r) { rt = r; }\n";
+
+static const struct runtime runtime = { aclosure, athunk, aatom, aforce, aapply };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER, building = PTHREAD_MUTEX_INITIALIZER;
+static struct known * known[BUCKETS];
+static unsigned long seen = 0;
+
+static TLS struct block * blocks = NULL;
+static TLS char * hp = NULL, * hend = NULL;
+static TLS unsigned int * out = NULL;
+static TLS size_t outp = 0, outsize = 0;
+static TLS struct job * jobs = NULL;
+static TLS unsigned int jobsize = 0;
+static TLS unsigned long betas = 0;
+static TLS bool budget = false;
+static TLS jmp_buf stop;
+static TLS const struct anode * program = NULL;
+
+static TLS struct anode * nodes = NULL;
+static TLS unsigned int count = 0, nodes_size = 0;
+static TLS struct aframe * frames = NULL;
+static TLS unsigned int sp = 0, frames_size = 0;
+static TLS struct candidate * cands = NULL;
+static TLS unsigned int ncands = 0, cands_size = 0;
+static TLS struct known ** todo = NULL;
+static TLS unsigned int todo_size = 0;
+
+/* Makes room for one more item in an array of *size items. */
+static void * agrow(void * p, unsigned int * size, size_t unit) {
+    *size = *size ? *size * 2 : 1024;
+    if (!(p = realloc(p, *size * unit)))
+        tnomem();
+    return p;
+}
+
+static void * aalloc(size_t n) {
+    void * p;
+    n = (n + 7) & ~(size_t) 7;
+    if ((size_t) (hend - hp) < n) {
+        size_t size = n > 1 << 20 ? n : 1 << 20;
+        struct block * b = malloc(sizeof(*b) + 8 + size);
+        if (!b)
+            tnomem();
+        b->next = blocks;
+        blocks = b;
+        hp = (char *) b + (sizeof(*b) + 7) / 8 * 8;
+        hend = hp + size;
+    }
+    p = hp;
+    hp += n;
+    return p;
+}
+
+static struct value * avalue(int tag) {
+    struct value * v = aalloc(sizeof(*v));
+    v->tag = tag;
+    v->a = NULL;
+    return v;
+}
+
+static struct value * awith(int tag, code_t code, int var, int n, va_list ap) {
+    struct value * v = avalue(tag);
+    int i;
+    v->code = code;
+    v->var = var;
+    v->env = aalloc(n * sizeof(*v->env));
+    for (i = 0; i < n; i++)
+        v->env[i] = va_arg(ap, struct value *);
+    return v;
+}
+
+static struct value * aclosure(code_t code, int var, int n, ...) {
+    struct value * v;
+    va_list ap;
+    va_start(ap, n);
+    v = awith(LAM, code, var, n, ap);
+    va_end(ap);
+    return v;
+}
+
+static struct value * athunk(code_t code, int n, ...) {
+    struct value * v;
+    va_list ap;
+    va_start(ap, n);
+    v = awith(THUNK, code, 0, n, ap);
+    va_end(ap);
+    return v;
+}
+
+static struct value * aatom(int var) {
+    struct value * v = avalue(FREE);
+    v->var = var;
+    return v;
+}
+
+static struct value * aforce(struct value * v) {
+    if (v->tag == THUNK && !v->a)
+        v->a = v->code(v->env, NULL);
+    else if (v->tag == ITHUNK && !v->a)
+        v->a = aeval(v->node, v->scope);
+    return v->tag == THUNK || v->tag == ITHUNK ? v->a : v;
+}
+
+static void aspend(void) {
+    if (budget && !tspend())
+        longjmp(stop, 1);
+    betas++;
+}
+
+/* Runs the body of a lambda with x for its argument. */
+static struct value * aenter(struct value * f, struct value * x) {
+    struct value * cell;
+    if (f->tag == LAM)
+        return f->code(f->env, x);
+    cell = avalue(ENV);
+    cell->a = x;
+    cell->scope = f->scope;
+    return aeval(&program[f->node->a], cell);
+}
+
+static struct value * aapply(struct value * f, struct value * x) {
+    struct value * v;
+    if (f->tag == LAM || f->tag == ILAM) {
+        aspend();
+        return aenter(f, x);
+    }
+    v = avalue(APP);
+    v->a = f;
+    v->b = x;
+    return v;
+}
+
+/* Evaluates a node to a lambda or a neutral value. An interpreted lambda in the
+ * function position is applied in place, so a chain of them doesn't go deeper
+ * into the C stack. */
+static struct value * aeval(const struct anode * p, struct value * scope) {
+    struct value * f, * x;
+    unsigned int i;
+    for (;;)
+        switch (p->type) {
+            case tlambda:
+                f = avalue(ILAM);
+                f->var = p->n;
+                f->node = p;
+                f->scope = scope;
+                return f;
+            case tapp:
+                f = aeval(&program[p->a], scope);
+                x = adelay(&program[p->b], scope);
+                if (f->tag != ILAM)
+                    return aapply(f, x);
+                aspend();
+                scope = avalue(ENV);
+                scope->a = x;
+                scope->scope = f->scope;
+                p = &program[f->node->a];
+                continue;
+            case tindex:
+                for (i = p->n; i; i--)
+                    scope = scope->scope;
+                return aforce(scope->a);
+            case tvariabl:
+                return aatom(p->n);
+            default:
+                return p->code(NULL, NULL);
+        }
+}
+
+/* Makes an argument: variables are passed on as they are, everything else but a
+ * lambda is delayed. */
+static struct value * adelay(const struct anode * p, struct value * scope) {
+    struct value * v;
+    unsigned int i;
+    switch (p->type) {
+        case tindex:
+            for (i = p->n; i; i--)
+                scope = scope->scope;
+            return scope->a;
+        case tapp:
+            v = avalue(ITHUNK);
+            v->node = p;
+            v->scope = scope;
+            return v;
+        case tcompiled:
+            return athunk(p->code, 0);
+        default:
+            return aeval(p, scope);
+    }
+}
+
+static void aput(unsigned int w) {
+    if (outp == outsize) {
+        outsize = outsize ? outsize * 2 : 1024;
+        if (!(out = realloc(out, outsize * sizeof(*out))))
+            tnomem();
+    }
+    out[outp++] = w;
+}
+
+static void aquote(struct value * v, unsigned int depth) {
+    struct value * x;
+    unsigned int n = 0;
+    for (;;) {
+        v = aforce(v);
+        switch (v->tag) {
+            case LAM:
+            case ILAM:
+                aput((unsigned int) (unsigned char) v->var << 2 | wlam);
+                x = avalue(VAR);
+                x->level = depth++;
+                v = aenter(v, x);
+                continue;
+            case APP:
+                aput(wapp);
+                if (n == jobsize)
+                    jobs = agrow(jobs, &jobsize, sizeof(*jobs));
+                jobs[n].v = v->b;
+                jobs[n++].depth = depth;
+                v = v->a;
+                continue;
+            case VAR:
+                aput((depth - 1 - v->level) << 2 | widx);
+                break;
+            default:
+                aput((unsigned int) (unsigned char) v->var << 2 | wvar);
+                break;
+        }
+        if (!n)
+            return;
+        v = jobs[--n].v;
+        depth = jobs[n].depth;
+    }
+}
+
+/* Hashes a node from its packed word and the hashes of its operands. */
+static unsigned long amix(unsigned int w, unsigned long a, unsigned long b) {
+    unsigned long h = (w + 1) * 0x9E3779B1UL ^ a * 31 ^ b * 0x85EBCA6BUL;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DUL;
+    return h ^ h >> 13;
+}
+
+/* Hashes a packed term the way aprogram() hashes its subterms, from the last
+ * word back, so the operands of a node are done before it. */
+static unsigned long ahash(const unsigned int * words, size_t size) {
+    unsigned long * stack = malloc(size * sizeof(*stack)), h;
+    size_t n = 0;
+    if (!stack)
+        tnomem();
+    while (size--)
+        switch (words[size] & 3) {
+            case wlam:
+                stack[n - 1] = amix(words[size], stack[n - 1], 0);
+                break;
+            case wapp:
+                n--;
+                stack[n - 1] = amix(words[size], stack[n], stack[n - 1]);
+                break;
+            default:
+                stack[n++] = amix(words[size], 0, 0);
+        }
+    h = stack[0];
+    free(stack);
+    return h;
+}
+
+/* Takes in a definition handed over by tdefinitions(), in the form the terms that
+ * use it have by the time they get here: with numerals for integers, on De
+ * Bruijn indices. One too big for its numerals can't be among them. */
+static void aknow(unsigned int * words, unsigned int size, void * arg) {
+    struct term_t * t = tunpack(words);
+    struct known * k, ** bucket;
+    size_t n;
+    (void) size;
+    (void) arg;
+    free(words);
+    tnamed(t);
+    if (!tchurch(t, NUMERAL_MAX)) {
+        tfparse(t);
+        return;
+    }
+    tdbruijn(t);
+    words = tpack(t, &n);
+    tfparse(t);
+    if (!(k = malloc(sizeof(*k))))
+        tnomem();
+    k->hash = ahash(words, n);
+    k->words = words;
+    k->size = n;
+    k->code = NULL;
+    k->failed = false;
+    pthread_mutex_lock(&lock);
+    bucket = &known[k->hash % BUCKETS];
+    for (k->next = *bucket; k->next; k->next = k->next->next)
+        if (k->next->hash == k->hash && k->next->size == n && !memcmp(k->next->words, words, n * sizeof(*words)))
+            break;
+    if (!k->next) {
+        k->next = *bucket;
+        *bucket = k;
+        k = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    if (k) {
+        free(words);
+        free(k);
+    }
+}
+
+/* Takes in the definitions made or loaded since the last look. Known ones are
+ * never dropped, so a redefined name leaves its old term behind. */
+static void arefresh(void) {
+    struct stats saved = tstats;
+    int result = tresult;
+    unsigned long since, now;
+    pthread_mutex_lock(&lock);
+    since = seen;
+    pthread_mutex_unlock(&lock);
+    now = tdefinitions(since, aknow, NULL);
+    pthread_mutex_lock(&lock);
+    if (seen == since)
+        seen = now;
+    pthread_mutex_unlock(&lock);
+    tstats = saved;
+    tresult = result;
+}
+
+static unsigned int anew(int type, unsigned int n, unsigned int a, unsigned int b) {
+    if (count == nodes_size)
+        nodes = agrow(nodes, &nodes_size, sizeof(*nodes));
+    nodes[count].type = type;
+    nodes[count].n = n;
+    nodes[count].a = a;
+    nodes[count].b = b;
+    return count++;
+}
+
+/* Turns a De Bruijn term into a program, and lists its closed subterms but the
+ * variables in cands, inner ones first. */
+static unsigned int aprogram(const struct term_t * t) {
+    unsigned int base = sp, start, r, loose;
+    unsigned long h;
+    count = ncands = 0;
+    for (;;) {
+        start = count;
+        switch (t->type) {
+            case tlambda:
+            case tapp: {
+                    if (sp == frames_size)
+                        frames = agrow(frames, &frames_size, sizeof(*frames));
+                    frames[sp].t = t;
+                    frames[sp].start = start;
+                    frames[sp++].n = 0;
+                    t = t->type == tlambda ? t->data.lambda_t.body : t->data.app_t.left;
+                    continue;
+                }
+            case tindex:
+                r = anew(tindex, t->data.index, 0, 0);
+                h = amix(t->data.index << 2 | widx, 0, 0);
+                loose = t->data.index + 1;
+                break;
+            case tvariabl:
+                r = anew(tvariabl, (unsigned char) t->data.var, 0, 0);
+                h = amix((unsigned int) (unsigned char) t->data.var << 2 | wvar, 0, 0);
+                loose = 0;
+                break;
+            default:
+                abort();
+        }
+        for (;;) {
+            struct aframe * f;
+            if (sp == base)
+                return r;
+            f = &frames[sp - 1];
+            t = f->t;
+            if (t->type == tapp && !f->n) {
+                f->n = 1;
+                f->left = r;
+                f->loose = loose;
+                f->hash = h;
+                t = t->data.app_t.right;
+                break;
+            }
+            sp--;
+            if (t->type == tlambda) {
+                r = anew(tlambda, (unsigned char) t->data.lambda_t.var, r, 0);
+                h = amix((unsigned int) (unsigned char) t->data.lambda_t.var << 2 | wlam, h, 0);
+                loose = loose ? loose - 1 : 0;
+            } else {
+                r = anew(tapp, 0, f->left, r);
+                h = amix(wapp, f->hash, h);
+                loose = f->loose > loose ? f->loose : loose;
+            }
+            if (!loose) {
+                if (ncands == cands_size)
+                    cands = agrow(cands, &cands_size, sizeof(*cands));
+                cands[ncands].t = t;
+                cands[ncands].node = r;
+                cands[ncands].start = f->start;
+                cands[ncands++].hash = h;
+            }
+        }
+    }
+}
+
+/* Finds the definitions among the closed subterms of the program, outermost
+ * first, compiles them if they aren't yet, and puts their code in place. */
+static void alink(void) {
+    unsigned int i, lo = -1U, ntodo = 0, n = 0;
+    bool needed = false;
+    struct term_t ** terms;
+    struct known * k;
+    struct build b;
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < ncands; i++)
+        cands[i].k = known[cands[i].hash % BUCKETS];
+    pthread_mutex_unlock(&lock);
+    /* Known definitions only ever go in front of a bucket, so the rest of it can
+     * be walked without the lock. */
+    for (i = ncands; i-- > 0; ) {
+        struct candidate * c = &cands[i];
+        unsigned int * words = NULL;
+        size_t size = 0;
+        if (c->node >= lo) {
+            c->k = NULL;
+            continue;
+        }
+        for (; c->k; c->k = c->k->next)
+            if (c->k->hash == c->hash) {
+                if (!words)
+                    words = tpack(c->t, &size);
+                if (c->k->size == size && !memcmp(c->k->words, words, size * sizeof(*words)))
+                    break;
+            }
+        free(words);
+        if (!c->k)
+            continue;
+        lo = c->start;
+        pthread_mutex_lock(&lock);
+        needed |= !c->k->code && !c->k->failed;
+        pthread_mutex_unlock(&lock);
+    }
+    /* Every definition that isn't compiled yet goes along with those needed now,
+     * so the compiler runs once for a prelude. What is defined between counting
+     * and listing them waits for the next time. */
+    if (needed) {
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < BUCKETS; i++)
+            for (k = known[i]; k; k = k->next)
+                n += !k->code && !k->failed;
+        pthread_mutex_unlock(&lock);
+        if (n > todo_size && !(todo = realloc(todo, (todo_size = n) * sizeof(*todo))))
+            tnomem();
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < BUCKETS; i++)
+            for (k = known[i]; k && ntodo < n; k = k->next)
+                if (!k->code && !k->failed)
+                    todo[ntodo++] = k;
+        pthread_mutex_unlock(&lock);
+    }
+    b.lib = NULL;
+    b.n = 0;
+    b.failed = false;
+    if (ntodo) {
+        if (!(terms = malloc(ntodo * sizeof(*terms))))
+            tnomem();
+        for (i = 0; i < ntodo; i++)
+            terms[i] = tunpack(todo[i]->words);
+        /* One thread compiles at a time, and leaves out what another one did while
+         * this one waited. */
+        pthread_mutex_lock(&building);
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < ntodo; i++)
+            if (!todo[i]->code && !todo[i]->failed) {
+                struct term_t * t = terms[i];
+                k = todo[i];
+                terms[i] = terms[b.n];
+                todo[i] = todo[b.n];
+                terms[b.n] = t;
+                todo[b.n++] = k;
+            }
+        pthread_mutex_unlock(&lock);
+        b.terms = terms;
+        if (b.n)
+            abig(abuild, &b);
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < b.n; i++)
+            if (b.lib)
+                todo[i]->code = b.defs[i];
+            else if (!b.failed)
+                todo[i]->failed = true;
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&building);
+        for (i = 0; i < ntodo; i++)
+            tfparse(terms[i]);
+        free(terms);
+    }
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < ncands; i++)
+        if (cands[i].k && cands[i].k->code) {
+            nodes[cands[i].node].type = tcompiled;
+            nodes[cands[i].node].code = cands[i].k->code;
+        }
+    pthread_mutex_unlock(&lock);
+    if (b.failed)
+        tfail(b.failure);
+    if (b.n && !b.lib) {
+        if (tbail)
+            tfail(fcompile);
+        fputs("Compilation failed.\n", stderr);
+    }
+}
+
+/* Marks the free indices of t, as seen from depth binders above it, in free. */
+static void acapture(const struct term_t * t, unsigned int depth, unsigned char * free, unsigned int n) {
+    for (;;)
+        switch (t->type) {
+            case tlambda: {
+                    t = t->data.lambda_t.body;
+                    depth++;
+                    continue;
+                }
+            case tapp: {
+                    acapture(t->data.app_t.left, depth, free, n);
+                    t = t->data.app_t.right;
+                    continue;
+                }
+            case tindex: {
+                    if (t->data.index >= depth && t->data.index - depth < n)
+                        free[t->data.index - depth] = 1;
+                    return;
+                }
+            default:
+                return;
+        }
+}
+
+static FILE * amemstream(char ** text, size_t * size) {
+    FILE * f = open_memstream(text, size);
+    if (!f)
+        tnomem();
+    return f;
+}
+
+/* Emits the function of a lambda (its body, with the argument as index 0) or of
+ * a thunk, and writes the expression building its closure to out. */
+static void afunction(const struct term_t * t, bool lambda, const struct scope * sc, FILE * out, struct emitter * em) {
+    unsigned char * seen = calloc(sc->n + 1, 1);
+    unsigned int id = em->ids++, i, k = 0;
+    struct scope inner;
+    char * text;
+    size_t size;
+    FILE * body;
+    if (!seen || !(inner.slots = malloc((sc->n + 1) * sizeof(*inner.slots))))
+        tnomem();
+    acapture(t, 0, seen, sc->n);
+    inner.n = sc->n + lambda;
+    if (lambda) {
+        inner.slots[0] = PARAM;
+        fprintf(out, "closure(F%u, %d, ", id, (unsigned char) t->data.lambda_t.var);
+    } else
+        fprintf(out, "thunk(F%u, ", id);
+    for (i = 0; i < sc->n; i++)
+        if (seen[i])
+            inner.slots[i + lambda] = k++;
+    fprintf(out, "%u", k);
+    for (i = 0; i < sc->n; i++)
+        if (seen[i]) {
+            fputs(", ", out);
+            aref(sc, i, out);
+        }
+    fputc(')', out);
+    body = amemstream(&text, &size);
+    fprintf(body, "static V * F%u(V ** env, V * x) {\n    return ", id);
+    aexpr(lambda ? t->data.lambda_t.body : t, &inner, body, em);
+    fputs(";\n}\n", body);
+    fclose(body);
+    fprintf(em->protos, "static V * F%u(V **, V *);\n", id);
+    fputs(text, em->defs);
+    free(text);
+    free(inner.slots);
+    free(seen);
+}
+
+static void aref(const struct scope * sc, unsigned int index, FILE * out) {
+    if (sc->slots[index] == PARAM)
+        fputc('x', out);
+    else
+        fprintf(out, "env[%d]", sc->slots[index]);
+}
+
+/* Emits an expression evaluating t to a lambda or a neutral value. */
+static void aexpr(const struct term_t * t, const struct scope * sc, FILE * out, struct emitter * em) {
+    switch (t->type) {
+        case tlambda:
+            afunction(t, true, sc, out, em);
+            return;
+        case tapp:
+            fputs("apply(", out);
+            aexpr(t->data.app_t.left, sc, out, em);
+            fputs(", ", out);
+            aarg(t->data.app_t.right, sc, out, em);
+            fputc(')', out);
+            return;
+        case tindex:
+            fputs("force(", out);
+            aref(sc, t->data.index, out);
+            fputc(')', out);
+            return;
+        case tvariabl:
+            fprintf(out, "atom(%d)", (unsigned char) t->data.var);
+            return;
+        default:
+            abort();
+    }
+}
+
+/* Emits an argument: variables are passed on as they are, everything else but a
+ * lambda is delayed. */
+static void aarg(const struct term_t * t, const struct scope * sc, FILE * out, struct emitter * em) {
+    if (t->type == tindex)
+        aref(sc, t->data.index, out);
+    else if (t->type == tlambda || t->type == tvariabl)
+        aexpr(t, sc, out, em);
+    else
+        afunction(t, false, sc, out, em);
+}
+
+/* Runs $CC, or gcc, to build source into so, and waits for it. */
+static bool acc(const char * source, const char * so) {
+    static const char * const flags[] = { "-O2", "-w", "-shared", "-fPIC", "-x", "c", "-o" };
+    extern char ** environ;
+    const char * cc = getenv("CC");
+    char * words, * w, ** argv;
+    unsigned int n = 0, i;
+    pid_t pid;
+    int status;
+    if (!cc)
+        cc = "gcc";
+    if (!(words = malloc(strlen(cc) + 1)) || !(argv = malloc((strlen(cc) / 2 + 12) * sizeof(*argv)))) {
+        free(words);
+        tnomem();
+    }
+    for (w = strcpy(words, cc); *w; ) {
+        while (*w == ' ' || *w == '\t')
+            *w++ = '\0';
+        if (!*w)
+            break;
+        argv[n++] = w;
+        while (*w && *w != ' ' && *w != '\t')
+            w++;
+    }
+    if (!n)
+        argv[n++] = "gcc";
+    for (i = 0; i < sizeof(flags) / sizeof(*flags); i++)
+        argv[n++] = (char *) flags[i];
+    argv[n++] = (char *) so;
+    argv[n++] = (char *) source;
+    argv[n] = NULL;
+    status = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    free(argv);
+    free(words);
+    if (status)
+        return false;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+/* Writes the C source of n closed De Bruijn terms to source and builds it into
+ * so. The object exports lambda_defs, the functions of the thunks of the terms in
+ * their order, and lambda_link, which hands it the runtime. */
+static bool acompile(struct term_t ** terms, unsigned int n, const char * source, const char * so) {
+    struct scope top = { 0, NULL };
+    struct emitter em;
+    char * protos, * defs, * discard;
+    size_t psize, dsize, size;
+    unsigned int * ids = malloc(n * sizeof(*ids)), i;
+    FILE * f, * out;
+    int status;
+    if (!ids)
+        tnomem();
+    em.protos = amemstream(&protos, &psize);
+    em.defs = amemstream(&defs, &dsize);
+    em.ids = 0;
+    out = amemstream(&discard, &size);
+    for (i = 0; i < n; i++) {
+        ids[i] = em.ids;
+        afunction(terms[i], false, &top, out, &em);
+    }
+    fclose(out);
+    fclose(em.protos);
+    fclose(em.defs);
+    free(discard);
+    if ((f = fopen(source, "w"))) {
+        fputs(interface, f);
+        fputs(protos, f);
+        fputs(defs, f);
+        fputs("V * (*const lambda_defs[])(V **, V *) = {", f);
+        for (i = 0; i < n; i++)
+            fprintf(f, "%s F%u", i ? "," : "", ids[i]);
+        fputs(" };\n", f);
+        status = fclose(f);
+    } else
+        status = -1;
+    free(protos);
+    free(defs);
+    free(ids);
+    return !status && acc(source, so);
+}
+
+/* Compiles, loads and links closed De Bruijn terms in a private directory, which
+ * is gone again by the time this returns. */
+static void * aload(struct term_t ** terms, unsigned int n) {
+    char dir[] = "/tmp/lambdaXXXXXX", source[sizeof(dir) + 8], so[sizeof(dir) + 8];
+    void (*link)(const struct runtime *);
+    void * lib = NULL;
+    if (!mkdtemp(dir))
+        return NULL;
+    sprintf(source, "%s/term.c", dir);
+    sprintf(so, "%s/term.so", dir);
+    if (acompile(terms, n, source, so) && (lib = dlopen(so, RTLD_NOW | RTLD_LOCAL))) {
+        if ((*(void **) &link = dlsym(lib, "lambda_link")) && dlsym(lib, "lambda_defs"))
+            link(&runtime);
+        else {
+            dlclose(lib);
+            lib = NULL;
+        }
+    }
+    unlink(source);
+    unlink(so);
+    rmdir(dir);
+    return lib;
+}
+
+/* Runs aload() for abig(), handing a failure back to the thread that asked. */
+static void * abuild(void * arg) {
+    struct build * b = arg;
+    jmp_buf bail, * volatile outer = tbail;
+    tbail = &bail;
+    if (setjmp(bail)) {
+        tbail = outer;
+        b->failed = true;
+        b->failure = tfailure;
+        return NULL;
+    }
+    if ((b->lib = aload(b->terms, b->n)))
+        b->defs = dlsym(b->lib, "lambda_defs");
+    tbail = outer;
+    return NULL;
+}
+
+/* Runs a program for abig(), with what is left of the budget. */
+static void * arun(void * arg) {
+    struct run * r = arg;
+    tlimit(r->fuel, r->ms);
+    budget = r->fuel || r->ms;
+    program = r->program;
+    betas = 0;
+    outp = outsize = 0;
+    if (!setjmp(stop))
+        aquote(aeval(&program[r->root], NULL), 0);
+    else {
+        free(out);
+        out = NULL;
+    }
+    while (blocks) {
+        struct block * b = blocks;
+        blocks = b->next;
+        free(b);
+    }
+    hp = hend = NULL;
+    r->words = out;
+    r->n = outp;
+    r->betas = betas;
+    r->result = tresult;
+    out = NULL;
+    return NULL;
+}
+
+/* The code generator, the interpreter and compiled code recurse on the C stack
+ * as deep as the term goes, so they get a thread with a big one. */
+static void abig(void * (*fn)(void *), void * arg) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, STACK_SIZE) || pthread_create(&thread, &attr, fn, arg))
+        fn(arg);
+    else
+        pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+void aevaldeep(struct term_t ** ppterm) {
+    struct run r;
+    if (!tleft(&r.fuel, &r.ms))
+        return;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    arefresh();
+    r.root = aprogram(*ppterm);
+    alink();
+    r.program = nodes;
+    abig(arun, &r);
+#ifndef NSTATS
+    tstats.betas += r.betas;
+#endif
+    if ((tresult = r.result) != rnormal) {
+        tnamed(*ppterm);
+        return;
+    }
+    tfparse(*ppterm);
+    *ppterm = tunpack(r.words);
+    free(r.words);
+    tnamed(*ppterm);
+}
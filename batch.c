@@ -0,0 +1,123 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "lambda.h"
+
+/* Results finished ahead of the one due next are held back, at most WINDOW of them
+ * per worker; a worker waits before reading a term that would not fit. */
+#define WINDOW 64
+
+struct result {
+    char * text;
+    size_t size;
+    bool ready;
+};
+
+/* Workers take turns reading the next term, so each term is parsed straight into
+ * the heap of the thread evaluating it. The results are printed in input order. */
+struct batch {
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+    struct source * src;
+    bool (*read)(struct source *, struct term_t **);
+    void (*run)(struct term_t *, FILE *);
+    bool done;
+    unsigned long next, due;
+    unsigned int window;
+    struct result * results;
+};
+
+static void * worker(void *);
+
+static void * worker(void * arg) {
+    struct batch * b = arg;
+    for (;;) {
+        struct term_t * t;
+        struct result r, * p;
+        unsigned long seq;
+        FILE * out;
+        pthread_mutex_lock(&b->lock);
+        while (!b->done && b->next - b->due == b->window)
+            pthread_cond_wait(&b->room, &b->lock);
+        if (b->done || !b->read(b->src, &t)) {
+            b->done = true;
+            pthread_cond_broadcast(&b->room);
+            pthread_mutex_unlock(&b->lock);
+            break;
+        }
+        seq = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (!(out = open_memstream(&r.text, &r.size)))
+            tnomem();
+        b->run(t, out);
+        treset();
+        fclose(out);
+        r.ready = true;
+        pthread_mutex_lock(&b->lock);
+        b->results[seq % b->window] = r;
+        while ((p = &b->results[b->due % b->window])->ready) {
+            fwrite(p->text, 1, p->size, stdout);
+            free(p->text);
+            p->ready = false;
+            b->due++;
+        }
+        pthread_cond_broadcast(&b->room);
+        pthread_mutex_unlock(&b->lock);
+    }
+    tclear();
+    uflush();
+    return NULL;
+}
+
+/* Reads every term of src with read and hands it to run on a pool of jobs threads,
+ * along with the stream to print the result to. A term that failed to parse is
+ * passed on as NULL. */
+void batch(struct source * src, bool (*read)(struct source *, struct term_t **),
+           void (*run)(struct term_t *, FILE *), unsigned int jobs) {
+    struct batch b;
+    pthread_t * threads;
+    unsigned int i, started;
+    b.src = src;
+    b.read = read;
+    b.run = run;
+    b.done = false;
+    b.next = b.due = 0;
+    b.window = WINDOW * jobs;
+    threads = malloc(jobs * sizeof(*threads));
+    b.results = calloc(b.window, sizeof(*b.results));
+    if (!threads || !b.results)
+        tnomem();
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.room, NULL);
+    /* Makes do with the workers that could be started, if any. */
+    for (started = 0; started < jobs; started++)
+        if (pthread_create(&threads[started], NULL, worker, &b))
+            break;
+    if (!started)
+        tfail(fthreads);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&b.room);
+    pthread_mutex_destroy(&b.lock);
+    free(b.results);
+    free(threads);
+}
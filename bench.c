@@ -0,0 +1,212 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "lambda.h"
+
+/* Benchmarks every workload at every size with every strategy, each run in a
+ * child process of its own so that the peak RSS is its own too. A run is stopped
+ * after a timeout or once it needs more memory than allowed, since some of the
+ * strategies never finish some of the workloads. The report is a table of tab
+ * separated values with a header line. */
+
+struct workload {
+    const char * name;
+    void (*gen)(FILE *, unsigned int);
+    unsigned int sizes[4];
+};
+
+struct strategy {
+    const char * name;
+    void (*eval)(struct term_t **);
+};
+
+static void num(FILE *, unsigned int);
+static void pow2(FILE *, unsigned int);
+static void fact(FILE *, unsigned int);
+static void ack(FILE *, unsigned int);
+static void deep(FILE *, unsigned int);
+static void wide(FILE *, unsigned int);
+static void capture(FILE *, unsigned int);
+static void measure(const struct workload *, unsigned int, const struct strategy *, unsigned int, unsigned long);
+
+#define Y "(\\f (\\x f (x x)) (\\x f (x x)))"
+#define SUCC "(\\n\\f\\x f (n f x))"
+#define PRED "(\\n\\f\\x n (\\g\\h h (g f)) (\\u x) (\\u u))"
+#define MULT "(\\m\\n\\f m (n f))"
+#define ISZERO "(\\n n (\\x\\a\\b b) (\\a\\b a))"
+
+static const struct workload workloads[] = {
+    { "pow", pow2, { 8, 12, 16 } },
+    { "fact", fact, { 3, 4, 5 } },
+    { "ack", ack, { 1, 2, 3 } },
+    { "deep", deep, { 1000, 3000, 10000 } },
+    { "wide", wide, { 1000, 10000, 100000 } },
+    { "capture", capture, { 100, 1000, 10000 } }
+};
+
+static const struct strategy strategies[] = {
+    { "name", evalbname },
+    { "value", evalbvalue },
+    { "deep", evaldeep }
+};
+
+static void num(FILE * f, unsigned int n) {
+    unsigned int i;
+    fputs("(\\f\\x ", f);
+    for (i = 0; i < n; i++)
+        fputs("f (", f);
+    putc('x', f);
+    for (i = 0; i <= n; i++)
+        putc(')', f);
+}
+
+/* 2^n, as n applied to 2. */
+static void pow2(FILE * f, unsigned int n) {
+    num(f, n);
+    num(f, 2);
+}
+
+static void fact(FILE * f, unsigned int n) {
+    fputs(Y " (\\r\\n " ISZERO " n ", f);
+    num(f, 1);
+    fputs(" (" MULT " n (r (" PRED " n))))", f);
+    num(f, n);
+}
+
+/* Ackermann's function of 3 and n. */
+static void ack(FILE * f, unsigned int n) {
+    num(f, 3);
+    fputs(" (\\g\\n n g (g ", f);
+    num(f, 1);
+    fputs(")) " SUCC, f);
+    num(f, n);
+}
+
+/* n identities applied inside each other. */
+static void deep(FILE * f, unsigned int n) {
+    unsigned int i;
+    for (i = 0; i < n; i++)
+        fputs("(\\x x) (", f);
+    putc('y', f);
+    for (i = 0; i < n; i++)
+        putc(')', f);
+}
+
+/* A variable applied to n independent redexes. */
+static void wide(FILE * f, unsigned int n) {
+    unsigned int i;
+    putc('v', f);
+    for (i = 0; i < n; i++) {
+        fputs(" (", f);
+        num(f, 3);
+        fputs(" (\\y y) z)", f);
+    }
+}
+
+/* Every step substitutes a term with y free under a binder of y. */
+static void capture(FILE * f, unsigned int n) {
+    unsigned int i;
+    for (i = 0; i < n; i++)
+        fputs("(\\x\\y\\z x y z) (", f);
+    putc('y', f);
+    for (i = 0; i < n; i++)
+        putc(')', f);
+}
+
+static void measure(const struct workload * w, unsigned int size, const struct strategy * s, unsigned int timeout,
+                    unsigned long memory) {
+    int status;
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        struct timespec start, end;
+        struct rusage usage;
+        struct term_t * t;
+        FILE * f;
+        char * text;
+        size_t length;
+        struct rlimit limit;
+        double seconds;
+        limit.rlim_cur = limit.rlim_max = memory << 20;
+        setrlimit(RLIMIT_AS, &limit);
+        alarm(timeout);
+        freopen("/dev/null", "w", stderr);
+        if (!(f = open_memstream(&text, &length)))
+            tnomem();
+        w->gen(f, size);
+        fclose(f);
+        t = tparse(text);
+        free(text);
+        memset(&tstats, 0, sizeof(tstats));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        s->eval(&t);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &usage);
+        seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%s\t%u\t%s\tok\t%.6f\t%lu\t%.0f\t%lu\t%ld\n", w->name, size, s->name, seconds,
+               tstats.betas, seconds > 0 ? tstats.betas / seconds : 0, tstats.allocs, usage.ru_maxrss);
+        exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status))
+        printf("%s\t%u\t%s\t%s\t\t\t\t\t\n", w->name, size, s->name,
+               WTERMSIG(status) == SIGALRM ? "timeout" : WTERMSIG(status) == SIGABRT ? "oom" : "crash");
+}
+
+main(argc, argv) int argc; char ** argv; {
+    unsigned int timeout = 5, i, j, k;
+    unsigned long memory = 2048;
+    char ** names = NULL;
+    
+    while (*++argv) {
+        if (strcmp(*argv, "-t") == 0 && argv[1])
+            timeout = atoi(*++argv);
+        else if (strcmp(*argv, "-m") == 0 && argv[1])
+            memory = atol(*++argv);
+        else if (!names)
+            names = argv;
+    }
+    
+    puts("workload\tsize\tstrategy\tstatus\tseconds\tbetas\tbetas_per_s\tallocs\tmax_rss_kb");
+    for (i = 0; i < sizeof(workloads) / sizeof(*workloads); i++) {
+        if (names) {
+            char ** p = names;
+            while (*p && **p != '-' && strcmp(*p, workloads[i].name))
+                p++;
+            if (!*p || **p == '-')
+                continue;
+        }
+        for (j = 0; j < 4 && workloads[i].sizes[j]; j++)
+            for (k = 0; k < sizeof(strategies) / sizeof(*strategies); k++)
+                measure(&workloads[i], workloads[i].sizes[j], &strategies[k], timeout, memory);
+    }
+    return 0;
+}
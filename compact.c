@@ -0,0 +1,363 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "lambda.h"
+
+#if UINT_MAX != 0xFFFFFFFF
+#error "The compact store needs a 32-bit unsigned int."
+#endif
+
+/* Strong normalization on a compact node store. A node is one 32-bit word with a
+ * two bit tag and a payload: the binder name of a lambda, the distance from an
+ * application to its right operand, an index or the name of a free variable. A
+ * term is laid out in preorder, so the body of a lambda and the left operand of
+ * an application follow right after it and every subterm is a contiguous run of
+ * words. Distances are relative, so runs can be moved around with memmove().
+ *
+ * The store is used as a stack: the normal form of a run is built on top of it,
+ * and once a redex has been contracted and normalized, the result is moved down
+ * over the words it came from. */
+#define TAG(w) ((w) & 3)
+#define LOAD(w) ((w) >> 2)
+#define NODE(tag, load) ((unsigned int) (load) << 2 | (tag))
+#define LOAD_MAX (UINT_MAX >> 2)
+
+enum {
+    clam,
+    capp,
+    cidx,
+    cvar
+};
+
+/* Pending work: the right operand of an application (fright), a possible redex
+ * (fredex), a normal form to move down (fmove), and the right operands still to
+ * be copied, shifted or converted by the other traversals. */
+struct cframe {
+    int kind;
+    unsigned int src, dst, depth;
+    const struct term_t * t;
+    struct term_t ** slot;
+};
+
+enum {
+    fright,
+    fredex,
+    fmove,
+    fsubst
+};
+
+static void creserve(unsigned int);
+static unsigned int cpush(unsigned int);
+static void fpush(int, unsigned int, unsigned int, unsigned int);
+static void cencode(const struct term_t *);
+static struct term_t * cdecode(unsigned int);
+static void cshift(unsigned int, unsigned int, unsigned int);
+static void csubst(unsigned int, unsigned int, unsigned int);
+static void cnorm(unsigned int);
+static void cclose(unsigned int, unsigned int);
+
+static TLS unsigned int * store = NULL;
+static TLS unsigned int top = 0, store_size = 0;
+static TLS struct cframe * frames = NULL;
+static TLS unsigned int fp = 0, frames_size = 0;
+
+static void creserve(unsigned int n) {
+    if (n > UINT_MAX - top)
+        tfail(fsize);
+    if (top + n > store_size) {
+        while (top + n > store_size)
+            store_size = store_size ? store_size * 2 : 65536;
+        if (!(store = realloc(store, (size_t) store_size * sizeof(*store))))
+            tnomem();
+    }
+}
+
+static unsigned int cpush(unsigned int w) {
+    creserve(1);
+    store[top] = w;
+    return top++;
+}
+
+static void fpush(int kind, unsigned int src, unsigned int dst, unsigned int depth) {
+    if (fp == frames_size) {
+        frames_size = frames_size ? frames_size * 2 : 1024;
+        if (!(frames = realloc(frames, frames_size * sizeof(*frames))))
+            tnomem();
+    }
+    frames[fp].kind = kind;
+    frames[fp].src = src;
+    frames[fp].dst = dst;
+    frames[fp++].depth = depth;
+}
+
+/* Sets the distance from the application at dst to its right operand, which is
+ * about to be pushed, leaving out the cut words in between that are yet to be
+ * dropped. */
+static void cright(unsigned int dst, unsigned int cut) {
+    if (top - dst - cut > LOAD_MAX)
+        tfail(fsize);
+    store[dst] = NODE(capp, top - dst - cut);
+}
+
+/* Appends a De Bruijn term to the store. */
+static void cencode(const struct term_t * t) {
+    unsigned int base = fp;
+    for (;;) {
+        switch (t->type) {
+            case tlambda: {
+                    cpush(NODE(clam, (unsigned char) t->data.lambda_t.var));
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    fpush(fright, 0, cpush(NODE(capp, 0)), 0);
+                    frames[fp - 1].t = t->data.app_t.right;
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            case tindex: {
+                    if (t->data.index > LOAD_MAX)
+                        tfail(fsize);
+                    cpush(NODE(cidx, t->data.index));
+                    break;
+                }
+            case tvariabl: {
+                    cpush(NODE(cvar, (unsigned char) t->data.var));
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (fp == base)
+            return;
+        cright(frames[--fp].dst, 0);
+        t = frames[fp].t;
+    }
+}
+
+static struct term_t * cdecode(unsigned int src) {
+    unsigned int base = fp;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        unsigned int w = store[src];
+        *slot = p = palloc();
+        switch (TAG(w)) {
+            case clam: {
+                    p->type = tlambda;
+                    p->data.lambda_t.var = LOAD(w);
+                    slot = &p->data.lambda_t.body;
+                    src++;
+                    continue;
+                }
+            case capp: {
+                    p->type = tapp;
+                    fpush(fright, src + LOAD(w), 0, 0);
+                    frames[fp - 1].slot = &p->data.app_t.right;
+                    slot = &p->data.app_t.left;
+                    src++;
+                    continue;
+                }
+            case cidx: {
+                    p->type = tindex;
+                    p->data.index = LOAD(w);
+                    break;
+                }
+            default: {
+                    p->type = tvariabl;
+                    p->data.var = LOAD(w);
+                }
+        }
+        if (fp == base)
+            return ret;
+        src = frames[--fp].src;
+        slot = frames[fp].slot;
+    }
+}
+
+/* Adds shift to the free indices of the run that starts at src. */
+static void cshift(unsigned int src, unsigned int end, unsigned int shift) {
+    unsigned int base = fp, depth = 0;
+    while (src < end) {
+        unsigned int w = store[src];
+        switch (TAG(w)) {
+            case clam: {
+                    depth++;
+                    src++;
+                    continue;
+                }
+            case capp: {
+                    fpush(fright, src + LOAD(w), 0, depth);
+                    src++;
+                    continue;
+                }
+            case cidx: {
+                    if (LOAD(w) >= depth)
+                        store[src] = NODE(cidx, LOAD(w) + shift);
+                    break;
+                }
+        }
+        if (fp == base)
+            return;
+        src = frames[--fp].src;
+        depth = frames[fp].depth;
+    }
+}
+
+/* Appends the lambda body at src with arg, the run [arg, end), put in for index 0. */
+static void csubst(unsigned int src, unsigned int arg, unsigned int end) {
+    unsigned int base = fp, depth = 0;
+    for (;;) {
+        unsigned int w = store[src];
+        switch (TAG(w)) {
+            case clam: {
+                    cpush(w);
+                    depth++;
+                    src++;
+                    continue;
+                }
+            case capp: {
+                    fpush(fsubst, src + LOAD(w), cpush(w), depth);
+                    src++;
+                    continue;
+                }
+            case cidx: {
+                    if (LOAD(w) == depth) {
+                        unsigned int at = top;
+                        STAT(substs);
+                        creserve(end - arg);
+                        memcpy(store + top, store + arg, (end - arg) * sizeof(*store));
+                        top += end - arg;
+                        if (depth)
+                            cshift(at, top, depth);
+                    } else
+                        cpush(LOAD(w) > depth ? NODE(cidx, LOAD(w) - 1) : w);
+                    break;
+                }
+            default:
+                cpush(w);
+        }
+        if (fp == base)
+            return;
+        cright(frames[--fp].dst, 0);
+        src = frames[fp].src;
+        depth = frames[fp].depth;
+    }
+}
+
+/* Pushes the normal form of the run at src, reducing the left operand and then
+ * the right one before contracting a redex, like evaldeep(). Once the budget runs
+ * out the rest of the term is copied as it is, and the contracta still pending
+ * are not moved down one by one, which would move everything above them every
+ * time. Their holes are chained through their first two words instead, the
+ * length and the hole above, and closed in one pass at the end. They are chained
+ * from the top down, as no redex is contracted after the stop. The distance to a
+ * right operand leaves out the words cut between the push of its frame, which
+ * keeps the count in depth, and its pop. */
+static void cnorm(unsigned int src) {
+    unsigned int base = fp, holes = 0, hole = 0, cut = 0;
+    bool stopped = false;
+    for (;;) {
+        unsigned int w = store[src];
+        switch (TAG(w)) {
+            case clam: {
+                    cpush(w);
+                    src++;
+                    continue;
+                }
+            case capp: {
+                    fpush(fright, src, cpush(w), cut);
+                    src++;
+                    continue;
+                }
+            default:
+                cpush(w);
+        }
+        for (;;) {
+            struct cframe f;
+            if (fp == base) {
+                cclose(hole, holes);
+                return;
+            }
+            f = frames[--fp];
+            if (f.kind == fright) {
+                cright(f.dst, cut - f.depth);
+                fpush(fredex, 0, f.dst, 0);
+                src = f.src + LOAD(store[f.src]);
+                break;
+            }
+            if (f.kind == fredex) {
+                unsigned int arg = f.dst + LOAD(store[f.dst]), end = top;
+                if (TAG(store[f.dst + 1]) != clam || stopped)
+                    continue;
+                if (!tspend()) {
+                    stopped = true;
+                    continue;
+                }
+                STAT(betas);
+                csubst(f.dst + 2, arg, end);
+                fpush(fmove, 0, f.dst, top);
+                src = end;
+                break;
+            }
+            /* fmove: the normal form of the contractum starts at f.depth. */
+            if (stopped) {
+                store[f.dst] = f.depth - f.dst;
+                store[f.dst + 1] = hole;
+                hole = f.dst;
+                holes++;
+                cut += f.depth - f.dst;
+                continue;
+            }
+            memmove(store + f.dst, store + f.depth, (top - f.depth) * sizeof(*store));
+            top = f.dst + (top - f.depth);
+        }
+    }
+}
+
+/* Drops the n holes chained from the lowest one at hole, see cnorm(). */
+static void cclose(unsigned int hole, unsigned int n) {
+    unsigned int to = hole;
+    if (!n)
+        return;
+    while (n--) {
+        unsigned int from = hole + store[hole], next = n ? store[hole + 1] : top;
+        memmove(store + to, store + from, (next - from) * sizeof(*store));
+        to += next - from;
+        hole = next;
+    }
+    top = to;
+}
+
+void cevaldeep(struct term_t ** ppterm) {
+    unsigned int src;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    top = fp = 0;
+    cencode(*ppterm);
+    tfparse(*ppterm);
+    src = top;
+    cnorm(0);
+    *ppterm = cdecode(src);
+    tnamed(*ppterm);
+}
@@ -0,0 +1,188 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "lambda.h"
+
+/* A context lends its heap to the calling thread for the length of a call, and
+ * takes it back on the way out. Running out of memory jumps back out of the call,
+ * which returns lcnomem; running out of free variables, threads that cannot be
+ * created, native code that does not compile and terms too big for the compact
+ * store return lcvars, lcthreads, lccompile and lcsize the same way. The term
+ * being parsed or evaluated may then be left half built: it must not be used
+ * again, and its nodes go with the context. */
+struct context {
+    struct heap heap;
+    unsigned long fuel, ms;
+    const char * error;
+};
+
+static int lfail(struct context *);
+static int lreturn(struct context *, int);
+
+static int lfail(struct context * c) {
+    tbail = NULL;
+    tunwind();
+    tswap(&c->heap);
+    c->error = tfailures[tfailure];
+    switch (tfailure) {
+        case fvars:
+            return lcvars;
+        case fthreads:
+            return lcthreads;
+        case fcompile:
+            return lccompile;
+        case fsize:
+            return lcsize;
+        default:
+            return lcnomem;
+    }
+}
+
+static int lreturn(struct context * c, int code) {
+    tbail = NULL;
+    tswap(&c->heap);
+    return code;
+}
+
+/* Makes a context drawing memory from alloc and giving it back to release, or
+ * from malloc() and free() if NULL. */
+struct context * lcnew(void * (*alloc)(size_t), void (*release)(void *)) {
+    struct context * c = alloc ? alloc(sizeof(*c)) : malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+    c->heap.alloc = alloc;
+    c->heap.release = release;
+    return c;
+}
+
+/* Frees the context along with every term it holds. */
+void lcfree(struct context * c) {
+    void (*release)(void *) = c->heap.release;
+    tswap(&c->heap);
+    tclear();
+    tswap(&c->heap);
+    if (release)
+        release(c);
+    else
+        free(c);
+}
+
+/* Stops later evaluations after fuel beta steps and ms milliseconds, either of
+ * them unlimited if 0. */
+void lclimit(struct context * c, unsigned long fuel, unsigned long ms) {
+    c->fuel = fuel;
+    c->ms = ms;
+}
+
+/* Parses the first term of the length bytes at text. */
+int lcparse(struct context * c, const char * text, size_t length, struct term_t ** t) {
+    struct source src;
+    jmp_buf bail;
+    src.name = NULL;
+    src.line = src.column = 0;
+    src.p = text;
+    src.end = text + length;
+    src.fd = -1;
+    src.buf = NULL;
+    src.map = NULL;
+    tswap(&c->heap);
+    if (setjmp(bail))
+        return lfail(c);
+    tbail = &bail;
+    if (!tsparse(&src, t)) {
+        *t = NULL;
+        c->error = "No term.";
+        return lreturn(c, lcsyntax);
+    }
+    if (!*t) {
+        c->error = terror;
+        return lreturn(c, lcsyntax);
+    }
+    return lreturn(c, lcok);
+}
+
+/* Evaluates a term of the context in place with one of the evaluators, like
+ * evaldeep() or kevalbname(). A term that ran out of fuel or time, or overflowed
+ * native arithmetic, is left as far as it got. */
+int lceval(struct context * c, struct term_t ** t, void (*eval)(struct term_t **)) {
+    jmp_buf bail;
+    tswap(&c->heap);
+    if (setjmp(bail))
+        return lfail(c);
+    tbail = &bail;
+    tlimit(c->fuel, c->ms);
+    eval(t);
+    switch (tresult) {
+        case rfuel:
+            c->error = "Out of fuel.";
+            return lreturn(c, lcfuel);
+        case rtime:
+            c->error = "Out of time.";
+            return lreturn(c, lctime);
+        case roverflow:
+            c->error = "Arithmetic overflow.";
+            return lreturn(c, lcoverflow);
+        default:
+            return lreturn(c, lcok);
+    }
+}
+
+/* Writes a term like tdparse() does, or like tswrite() if plain is set, to a
+ * string from the allocator of the context, ending in a NUL not counted in
+ * *length. */
+int lcwrite(struct context * c, const struct term_t * t, bool plain, char ** text, size_t * length) {
+    void * (*alloc)(size_t) = c->heap.alloc;
+    jmp_buf bail;
+    char * buf;
+    size_t size;
+    FILE * f;
+    tswap(&c->heap);
+    if (setjmp(bail))
+        return lfail(c);
+    tbail = &bail;
+    if (!(f = open_memstream(&buf, &size)))
+        tnomem();
+    (plain ? tswrite : tdparse)(t, f);
+    if (fclose(f))
+        tnomem();
+    *text = alloc ? alloc(size + 1) : malloc(size + 1);
+    if (!*text) {
+        free(buf);
+        tnomem();
+    }
+    memcpy(*text, buf, size + 1);
+    *length = size;
+    free(buf);
+    return lreturn(c, lcok);
+}
+
+/* Frees a term of the context. */
+int lcrelease(struct context * c, struct term_t * t) {
+    tswap(&c->heap);
+    tfparse(t);
+    return lreturn(c, lcok);
+}
+
+const char * lcerror(const struct context * c) {
+    return c->error;
+}
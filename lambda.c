@@ -17,117 +17,390 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include "lambda.h"
 
-#define EMPTY_BITMAP {{ 0, 0, 0, 0}}
+#define SLAB_SIZE 4096
+#define CUTOFF 256
+#define DEQUE_SIZE 64
+#define TICKS 64
+#define NAME_SIZE 256
+#define OUT_SIZE 65536
+
+/* Terms are carved out of slabs of SLAB_SIZE nodes. Freed nodes go onto a free
+ * list threaded through data.app_t.left, and treset() drops everything at once. */
+struct slab {
+    struct slab * next;
+    struct term_t nodes[SLAB_SIZE];
+};
+
+/* Binders enclosing the node being visited by the De Bruijn conversions. level[]
+ * holds the depth of the innermost binder of a name, from one, and shadowed what
+ * it held before that binder. */
+struct scope {
+    struct binder {
+        char name;
+        unsigned int shadowed;
+    } * binders;
+    unsigned int depth, size;
+    unsigned int level[256];
+    struct bitmap free_vars;
+};
+
+/* The occurrences in a term that tnamed() names, numbered in the order dname()
+ * visits the nodes. Key k < 256 stands for the free variable k, and 256 + d for
+ * the binder d levels deep. The positions of the occurrences of key k are
+ * at[first[k]] up to at[first[k + 1]], in order, next[k] is where to look for the
+ * next one, and last[p] is the position of the last node below the lambda at p. */
+struct occurs {
+    unsigned int * first, * next, * at, * last;
+    unsigned int keys;
+};
+
+/* Pending work of the traversals below, none of which recurse on the C stack. A
+ * traversal only ever pops the frames it pushed itself, so they nest freely. */
+struct frame {
+    struct term_t * t;
+    struct term_t ** slot;
+    const struct term_t * src;
+    unsigned int n;
+};
+
+/* Kinds of the parser frames, kept in frame.n. A lambda frame adds its binder and
+ * 256 times the origin of the lambda. */
+enum {
+    proot,
+    pparen,
+    plam
+};
+
+typedef void (*beta_t)(struct term_t *, const struct term_t *);
+
+/* Strong normalization on several threads. An application whose operands both
+ * have at least CUTOFF nodes may leave its right operand as a task on the deque of
+ * the thread normalizing it while that thread goes on with the left operand, as
+ * long as some thread is idle. Idle threads steal the oldest task of another deque.
+ * The operands are separate trees, so both can be rewritten in place at once. The
+ * nodes a thread builds stay in its heap until it hands them over at the end. */
+struct task {
+    struct term_t ** slot;
+    bool done;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    unsigned int bottom, top;
+    struct task tasks[DEQUE_SIZE];
+    struct pool * pool;
+    struct slab * heap;
+    struct stats stats;
+};
+
+/* Steps and time the evaluators of a thread may still spend, see tlimit(). The
+ * clock is only read every TICKS steps. */
+struct budget {
+    bool fueled, timed;
+    unsigned long fuel;
+    unsigned int ticks;
+    struct timespec deadline;
+};
+
+/* Bits read from or written to a binary term, n of them pending in byte. */
+struct bits {
+    unsigned int byte, n;
+};
 
-struct bitmap {
-    unsigned int t[4];
+/* The workers started by tparallel() wait on wake between the rounds pdeep()
+ * runs, and for tasks once they found none. A round starts when round changes
+ * and ends with stop; every worker then hands its nodes over and counts itself
+ * in parked. pspawn() bumps posted with every task. One thread at a time runs
+ * rounds, holding busy. The threads of a round with a fuel budget all take their
+ * steps off fuel. */
+struct pool {
+    beta_t beta;
+    struct heap heap;
+    unsigned int size;
+    volatile unsigned int idle;
+    volatile unsigned long fuel;
+    volatile bool stop;
+    volatile int halt;
+    struct budget budget;
+    struct deque * deques;
+    pthread_t * ids;
+    pthread_mutex_t lock, busy;
+    pthread_cond_t wake, done;
+    unsigned int round, posted, parked;
+    bool quit;
 };
 
-static struct term_t * palloc(void);
-static char * nexttoken(char *, char * );
-static char * nextparen(char *, struct term_t **);
-static char * nextlambda(char *, struct term_t **);
-static char * nextapp(char *, struct term_t **);
+static void oputc(int, FILE *);
+static void oputs(const char *, FILE *);
+static void oindex(unsigned int, FILE *);
+static void oflush(FILE *);
+static int sgetc(struct source *);
+static int speek(struct source *);
+static struct term_t * pvar(char);
+static void pappend(struct term_t *);
+static bool plambda(void);
+static struct slab * tdetach(void);
+static void tadopt(struct slab *);
+static void wpush(struct term_t *, struct term_t **, const struct term_t *, unsigned int);
+static int bget(struct source *, struct bits *);
+static void bput(struct bits *, int, FILE *);
+static void bindex(struct bits *, unsigned int, FILE *);
 static void setbitmap(struct bitmap *, char);
 static void clearbitmap(struct bitmap *, char);
 static bool bitmapisset(const struct bitmap *, char);
+static void bitmapunion(struct bitmap *, const struct bitmap *);
 static char bitmapfresh(const struct bitmap *, const struct bitmap *);
-static void freevars(const struct term_t *, struct bitmap *, struct bitmap);
+static const struct bitmap * freevars(struct term_t *);
 static void alpha(struct term_t *, char, char);
-static void rec(struct term_t *, char, const struct term_t *, const struct bitmap *);
+static void rec(struct term_t *, char, const struct term_t *, bool);
+static void pushbinder(struct scope *, char);
+static void dindex(struct term_t *, struct scope *);
+static void dused(const struct term_t *, const struct scope *, unsigned int, struct bitmap *);
+static void dname(struct term_t *, struct scope *, struct occurs *);
+static unsigned int dwalk(const struct term_t *, struct occurs *, bool);
+static void dkey(struct occurs *, unsigned int, unsigned int, bool);
+static bool dusing(struct occurs *, unsigned int, unsigned int);
+static struct term_t * dcopy(const struct term_t *, unsigned int, unsigned int);
+static void dsubst(struct term_t *, unsigned int, const struct term_t *);
+static unsigned int occurs(const struct term_t *, char, bool *);
+static bool neutral(const struct term_t *);
+static bool simplify(struct term_t **, bool);
+static unsigned int tsize(const struct term_t *);
+static bool pspawn(struct term_t *);
+static bool pjoin(void);
+static bool psteal(void);
+static void * pworker(void *);
+static bool pdeep(struct term_t **, beta_t);
+static void pstop(void);
+static void bnumeral(struct term_t **, beta_t);
+static int bprimitive(struct term_t **, beta_t);
+static void deep(struct term_t **, beta_t);
+static void shead(struct term_t **, FILE *);
+static void tmerge(const struct stats *);
 
 static const struct bitmap empty_set = EMPTY_BITMAP;
 static const char var_set_str[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-static struct bitmap var_set = EMPTY_BITMAP;
+/* The names in var_set_str. */
+static const struct bitmap var_set = {{ 0, 0x03FF0000, 0x07FFFFFE, 0x07FFFFFE }};
+static TLS struct heap heap;
+static TLS char out[OUT_SIZE];
+static TLS unsigned int outp = 0;
+static TLS struct frame * work = NULL;
+static TLS unsigned int workp = 0, work_size = 0;
+
+static struct pool * team = NULL;
+static TLS struct pool * pool = NULL;
+static TLS struct deque * own = NULL;
+
+static TLS struct budget budget;
+
+TLS const char * terror = NULL;
+TLS int tresult = rnormal;
+TLS struct stats tstats;
+TLS jmp_buf * tbail = NULL;
+TLS int tfailure = 0;
+
+const char * const tfailures[] = {
+    NULL,
+    "Out of memory.",
+    "Out of free variables.",
+    "Cannot create threads.",
+    "Compilation failed.",
+    "Term too big."
+};
 
-static struct term_t * palloc(void) {
-    struct term_t * t = malloc(sizeof(*t));
-    if (!t) {
-        fputs("Out of memory.", stderr);
-        abort();
+/* Gives up on whatever the calling thread is doing: at the point tbail was set
+ * if it is, or for good otherwise. */
+void tfail(int why) {
+    if (tbail) {
+        tfailure = why;
+        longjmp(*tbail, 1);
     }
+    fprintf(stderr, "%s\n", tfailures[why]);
+    abort();
+}
+
+void tnomem(void) {
+    tfail(fnomem);
+}
+
+/* Forgets the pending work of a thread that gave up, see context.c. */
+void tunwind(void) {
+    workp = 0;
+    outp = 0;
+    mabandon(0);
+    shclear();
+    kclear();
+}
+
+/* Exchanges the heap of the calling thread with *h. */
+void tswap(struct heap * h) {
+    struct heap tmp = heap;
+    heap = *h;
+    *h = tmp;
+}
+
+#ifdef PALLOC_MALLOC
+struct term_t * palloc(void) {
+    struct term_t * t = heap.alloc ? heap.alloc(sizeof(*t)) : malloc(sizeof(*t));
+    STAT(allocs);
+    STATMAX(peak, tstats.allocs - tstats.frees);
+    if (!t)
+        tnomem();
+    t->origin = 0;
     return t;
 }
 
-static char * nexttoken(char * s, char * t) {
-    while (isspace(*s))
-        s++;
-    *t = *s;
-    return *s ? s + 1 : s;
-}
-
-static char * nextparen(char * s, struct term_t ** t) {
-    char * p;
-    char c;
-    p = nexttoken(s, &c);
-    if (c == 0)
-        return s;
-    else if (c == '(') {
-        struct term_t * paren = NULL;
-        p = nextapp(p, &paren);
-        if (!paren) {
-            puts("Invalid parenthesis content.");
-            return s;
-        }
-        p = nexttoken(p, &c);
-        if (c != ')') {
-            puts("Parenthesis mismatch.");
-            return s;
-        }
-        *t = paren;
-        s = p;
-    } else if (c == ')')
-        return s;
+void pfree(struct term_t * t) {
+    STAT(frees);
+    if (heap.release)
+        heap.release(t);
+    else
+        free(t);
+}
+
+/* Nodes are not tracked here, they go back one by one: whoever holds a term must
+ * tfparse() it. Only the work stack and the cells of the other evaluators are
+ * left to give back. */
+void tclear(void) {
+    free(work);
+    work = NULL;
+    workp = work_size = 0;
+    shclear();
+    kclear();
+}
+
+void treset(void) {
+    memset(&tstats, 0, sizeof(tstats));
+}
+
+static struct slab * tdetach(void) {
+    free(work);
+    work = NULL;
+    workp = work_size = 0;
+    return NULL;
+}
+
+static void tadopt(struct slab * s) {
+}
+#else
+struct term_t * palloc(void) {
+    struct term_t * t = heap.free_list;
+    STAT(allocs);
+    STATMAX(peak, tstats.allocs - tstats.frees);
+    if (t)
+        heap.free_list = t->data.app_t.left;
     else {
-        struct term_t * var = palloc();
-        var->type = tvariabl;
-        var->data.var = c;
-        *t = var;
-        s = p;
+        if (!heap.slabs || heap.slab_used == SLAB_SIZE) {
+            struct slab * s = heap.alloc ? heap.alloc(sizeof(*s)) : malloc(sizeof(*s));
+            if (!s)
+                tnomem();
+            s->next = heap.slabs;
+            heap.slabs = s;
+            heap.slab_used = 0;
+        }
+        t = &heap.slabs->nodes[heap.slab_used++];
     }
-    return s;
+    t->origin = 0;
+    return t;
 }
 
-static char * nextlambda(char * s, struct term_t ** t) {
-    struct term_t * lambda = NULL;
-    char * p;
-    char c;
-    p = nexttoken(s, &c);
-    if (c == '\\') {
-        struct term_t * body = NULL;
-        p = nexttoken(p, &c);
-        if (c == 0) {
-            puts("Unexpected end of input while reading variable.");
-            goto finish;
-        }
-        if (c == '\\' || c == '(' || c == ')') {
-            puts("Invalid varable name in lambda_tbda.");
-            goto finish;
-        }
-        p = nextapp(p, &body);
-        if (!body) {
-            puts("Empty body found in lambda_tbda");
-            goto finish;
-        }
-        lambda = palloc();
-        lambda->type = tlambda;
-        lambda->data.lambda_t.var = c;
-        lambda->data.lambda_t.body = body;
-        s = p;
-    } else
-        s = nextparen(s, &lambda);
-finish:
-    *t = lambda;
+void pfree(struct term_t * t) {
+    STAT(frees);
+    t->data.app_t.left = heap.free_list;
+    heap.free_list = t;
+}
+
+static void srelease(struct slab * s) {
+    if (heap.release)
+        heap.release(s);
+    else
+        free(s);
+}
+
+void treset(void) {
+    /* Keep one slab around so that the next term doesn't hit malloc at all. */
+    struct slab * s;
+    memset(&tstats, 0, sizeof(tstats));
+    if (!heap.slabs)
+        return;
+    while ((s = heap.slabs->next)) {
+        heap.slabs->next = s->next;
+        srelease(s);
+    }
+    heap.free_list = NULL;
+    heap.slab_used = 0;
+}
+
+/* Gives every slab back, and the work stack and the cells of the other evaluators
+ * with them, leaving the statistics alone. */
+void tclear(void) {
+    struct slab * s;
+    free(work);
+    work = NULL;
+    workp = work_size = 0;
+    shclear();
+    kclear();
+    while ((s = heap.slabs)) {
+        heap.slabs = s->next;
+        srelease(s);
+    }
+    heap.free_list = NULL;
+}
+
+/* Hands everything the calling thread holds over to tadopt() in another thread. */
+static struct slab * tdetach(void) {
+    struct slab * s = heap.slabs;
+    heap.slabs = NULL;
+    heap.free_list = NULL;
+    free(work);
+    work = NULL;
+    workp = work_size = 0;
     return s;
 }
 
+/* Links the slabs in behind the one being carved up, so that treset() frees them. */
+static void tadopt(struct slab * s) {
+    struct slab * tail = s;
+    if (!s)
+        return;
+    if (!heap.slabs) {
+        heap.slabs = s;
+        return;
+    }
+    while (tail->next)
+        tail = tail->next;
+    tail->next = heap.slabs->next;
+    heap.slabs->next = s;
+}
+#endif
+
+static void wpush(struct term_t * t, struct term_t ** slot, const struct term_t * src, unsigned int n) {
+    if (workp == work_size) {
+        work_size = work_size ? work_size * 2 : 1024;
+        if (!(work = realloc(work, work_size * sizeof(*work))))
+            tnomem();
+    }
+    work[workp].t = t;
+    work[workp].slot = slot;
+    work[workp].src = src;
+    work[workp++].n = n;
+}
+
 static void setbitmap(struct bitmap * bmp, char c) {
     bmp->t[c/32] |= 1 << c%32;
 }
@@ -140,6 +413,12 @@ static bool bitmapisset(const struct bitmap * bmp, char c) {
     return bmp->t[c/32] & 1 << c%32;
 }
 
+static void bitmapunion(struct bitmap * bmp, const struct bitmap * set) {
+    int i;
+    for (i = 0; i < 4; i++)
+        bmp->t[i] |= set->t[i];
+}
+
 static char bitmapfresh(const struct bitmap * set0, const struct bitmap * set1) {
     int i;
     char fresh = 0;
@@ -161,335 +440,2020 @@ static char bitmapfresh(const struct bitmap * set0, const struct bitmap * set1)
         }
     }
     if (!fresh) {
+        if (tbail)
+            tfail(fvars);
         puts("Running out of free variables.");
         fresh = '!';
     }
     return fresh;
 }
 
-static void freevars(const struct term_t * t, struct bitmap * free_vars, struct bitmap bound_vars) {
-    const struct term_t * pterm = t;
-    for (;;)
-        switch (pterm->type) {
-            case tlambda: {
-                    setbitmap(&bound_vars, pterm->data.lambda_t.var);
-                    pterm = pterm->data.lambda_t.body;
-                    continue;
-                }
-            case tapp: {
-                    freevars(pterm->data.app_t.left, free_vars, bound_vars);
-                    pterm = pterm->data.app_t.right;
-                    continue;
-                }
-            case tvariabl: {
-                    if (bitmapisset(&bound_vars, pterm->data.var))
-                        return;
-                    setbitmap(free_vars, pterm->data.var);
-                    return;
-                }
-            default:
-                abort();
+/* Recomputes the cached free variable sets of a whole term. */
+static const struct bitmap * freevars(struct term_t * t) {
+    unsigned int base = workp;
+    STAT(walks);
+    wpush(t, NULL, NULL, 0);
+    while (workp > base) {
+        struct term_t * pterm = work[workp - 1].t;
+        if (!work[workp - 1].n) {
+            work[workp - 1].n = 1;
+            switch (pterm->type) {
+                case tlambda: {
+                        wpush(pterm->data.lambda_t.body, NULL, NULL, 0);
+                        continue;
+                    }
+                case tapp: {
+                        wpush(pterm->data.app_t.left, NULL, NULL, 0);
+                        wpush(pterm->data.app_t.right, NULL, NULL, 0);
+                        continue;
+                    }
+                case tvariabl: {
+                        pterm->free_vars = empty_set;
+                        setbitmap(&pterm->free_vars, pterm->data.var);
+                        workp--;
+                        continue;
+                    }
+                case tnumber:
+                case tprim: {
+                        pterm->free_vars = empty_set;
+                        workp--;
+                        continue;
+                    }
+                default:
+                    abort();
+            }
         }
+        workp--;
+        if (pterm->type == tlambda) {
+            pterm->free_vars = pterm->data.lambda_t.body->free_vars;
+            clearbitmap(&pterm->free_vars, pterm->data.lambda_t.var);
+        } else {
+            pterm->free_vars = pterm->data.app_t.left->free_vars;
+            bitmapunion(&pterm->free_vars, &pterm->data.app_t.right->free_vars);
+        }
+    }
+    return &t->free_vars;
 }
 
+/* Renames the free occurrences of old, skipping subterms that don't mention it. */
 static void alpha(struct term_t * t, char old, char new) {
+    unsigned int base = workp;
     struct term_t * pterm = t;
-    for (;;)
-        switch (pterm->type) {
-            case tlambda: {
-                    if (pterm->data.lambda_t.var == old)
-                        return;
-                    pterm = pterm->data.lambda_t.body;
+    STAT(renames);
+    if (ucharged)
+        ucharged->renames++;
+    for (;;) {
+        if (bitmapisset(&pterm->free_vars, old)) {
+            clearbitmap(&pterm->free_vars, old);
+            setbitmap(&pterm->free_vars, new);
+            switch (pterm->type) {
+                case tlambda: {
+                        if (pterm->data.lambda_t.var == old)
+                            break;
+                        pterm = pterm->data.lambda_t.body;
+                        continue;
+                    }
+                case tapp: {
+                        wpush(pterm->data.app_t.left, NULL, NULL, 0);
+                        pterm = pterm->data.app_t.right;
+                        continue;
+                    }
+                case tvariabl: {
+                        if (pterm->data.var == old)
+                            pterm->data.var = new;
+                        break;
+                    }
+                default:
+                    abort();
+            }
+        }
+        if (workp == base)
+            return;
+        pterm = work[--workp].t;
+    }
+}
+
+/* Substitutes s for the free occurrences of v, skipping subterms that don't mention it.
+ * With move, v occurs once and takes the nodes of s over instead of a copy; the
+ * root node of s is left to the caller. */
+static void rec(struct term_t * t, char v, const struct term_t * s, bool move) {
+    unsigned int base = workp;
+    struct term_t * pterm = t;
+    for (;;) {
+        if (bitmapisset(&pterm->free_vars, v) && (pterm->type != tlambda || pterm->data.lambda_t.var != v)) {
+            clearbitmap(&pterm->free_vars, v);
+            bitmapunion(&pterm->free_vars, &s->free_vars);
+            switch (pterm->type) {
+                case tlambda: {
+                        if (bitmapisset(&s->free_vars, pterm->data.lambda_t.var)) {
+                            register char u = bitmapfresh(&pterm->data.lambda_t.body->free_vars, &s->free_vars);
+                            alpha(pterm->data.lambda_t.body, pterm->data.lambda_t.var, u);
+                            pterm->data.lambda_t.var = u;
+                        }
+                        pterm = pterm->data.lambda_t.body;
+                        continue;
+                    }
+                case tapp: {
+                        wpush(pterm->data.app_t.left, NULL, NULL, 0);
+                        pterm = pterm->data.app_t.right;
+                        continue;
+                    }
+                case tvariabl: {
+                        struct term_t * copy;
+                        if (pterm->data.var != v)
+                            break;
+                        if (move) {
+                            *pterm = *s;
+                            break;
+                        }
+                        *pterm = *(copy = tcparse(s));
+                        pfree(copy);
+                        break;
+                    }
+                default:
+                    abort();
+            }
+        }
+        if (workp == base)
+            return;
+        pterm = work[--workp].t;
+    }
+}
+
+static bool isvalue(const struct term_t * pterm) {
+    return pterm->type == tlambda || pterm->type == tvariabl || pterm->type == tindex
+        || pterm->type == tnumber || pterm->type == tprim;
+}
+
+static int sgetc(struct source * src) {
+    int c;
+    if (src->p == src->end && !sfill(src))
+        return EOF;
+    if ((c = (unsigned char) *src->p++) == '\n') {
+        src->line++;
+        src->column = 0;
+    } else
+        src->column++;
+    return c;
+}
+
+static int speek(struct source * src) {
+    if (src->p == src->end && !sfill(src))
+        return EOF;
+    return (unsigned char) *src->p;
+}
+
+static struct term_t * pvar(char c) {
+    struct term_t * var = palloc();
+    var->type = tvariabl;
+    var->data.var = c;
+    var->free_vars = empty_set;
+    setbitmap(&var->free_vars, c);
+    return var;
+}
+
+/* Appends a finished operand to the application built by the innermost frame. */
+static void pappend(struct term_t * right) {
+    struct term_t ** left = &work[workp - 1].t;
+    if (*left) {
+        struct term_t * top = palloc();
+        top->type = tapp;
+        top->data.app_t.left = *left;
+        top->data.app_t.right = right;
+        top->free_vars = (*left)->free_vars;
+        bitmapunion(&top->free_vars, &right->free_vars);
+        *left = top;
+    } else
+        *left = right;
+}
+
+/* Closes the innermost frame, which is a lambda, around the body read so far. */
+static bool plambda(void) {
+    struct frame * f = &work[--workp];
+    struct term_t * lambda;
+    if (!f->t) {
+        terror = "Empty body found in lambda_tbda";
+        return false;
+    }
+    lambda = palloc();
+    lambda->type = tlambda;
+    lambda->data.lambda_t.var = (f->n - plam) & 0xFF;
+    lambda->origin = (f->n - plam) >> 8;
+    lambda->data.lambda_t.body = f->t;
+    lambda->free_vars = f->t->free_vars;
+    clearbitmap(&lambda->free_vars, lambda->data.lambda_t.var);
+    pappend(lambda);
+    return true;
+}
+
+/* Reads the next term from the input, one character at a time. A lambda body
+ * extends as far right as possible, so every open lambda and parenthesis is a frame
+ * on the work stack holding the application read so far. A term ends at a newline
+ * outside of parentheses unless a lambda is still waiting for its body, and a line
+ * holding just a dot ends the input. A term that starts with [name] = defines name
+ * instead, and [name] stands for a copy of the definition in later terms. #n and
+ * #name are native integers and primitives, see native.c. Returns
+ * false at the end of the input, and true with *t set to NULL after a parse error,
+ * once the bad term was skipped; terror then tells what was wrong. */
+bool tsparse(struct source * src, struct term_t ** t) {
+    unsigned int base = workp;
+    int c, depth = 0;
+    *t = NULL;
+    wpush(NULL, NULL, NULL, proot);
+    for (;;) {
+        c = sgetc(src);
+        if (c == EOF)
+            break;
+        if (c == '\n') {
+            if (depth || (workp == base + 1 && !work[base].t) || (work[workp - 1].n >= plam && !work[workp - 1].t))
+                continue;
+            break;
+        }
+        if (isspace(c))
+            continue;
+        switch (c) {
+            case '.': {
+                    if (workp == base + 1 && !work[base].t && (speek(src) == '\n' || speek(src) == EOF)) {
+                        workp = base;
+                        return false;
+                    }
+                    pappend(pvar(c));
                     continue;
                 }
-            case tapp: {
-                    alpha(pterm->data.app_t.left, old, new);
-                    pterm = pterm->data.app_t.right;
+            case '\\': {
+                    unsigned int origin = uprofiling && src->name ? usite(src->name, src->line + 1, src->column) : 0;
+                    while ((c = sgetc(src)) != EOF && isspace(c))
+                        ;
+                    if (c == EOF) {
+                        terror = "Unexpected end of input while reading variable.";
+                        goto error;
+                    }
+                    if (c == '\\' || c == '(' || c == ')') {
+                        terror = "Invalid varable name in lambda_tbda.";
+                        goto error;
+                    }
+                    wpush(NULL, NULL, NULL, plam + (unsigned char) c + (origin << 8));
                     continue;
                 }
-            case tvariabl: {
-                    if (pterm->data.var == old)
-                        pterm->data.var = new;
-                    return;
+            case '[': {
+                    char name[NAME_SIZE];
+                    size_t length = 0;
+                    struct term_t * def;
+                    bool start = workp == base + 1 && !work[base].t;
+                    while ((c = sgetc(src)) != EOF && c != ']' && c != '\n') {
+                        if (length == sizeof(name)) {
+                            terror = "Name too long.";
+                            goto error;
+                        }
+                        name[length++] = c;
+                    }
+                    if (c != ']') {
+                        terror = "Unterminated name.";
+                        goto error;
+                    }
+                    while (start && (speek(src) == ' ' || speek(src) == '\t'))
+                        sgetc(src);
+                    if (!start || speek(src) != '=') {
+                        if (!(def = tlookup(name, length))) {
+                            terror = "Undefined name.";
+                            goto error;
+                        }
+                        if (uprofiling)
+                            ustamp(def, name, length);
+                        pappend(def);
+                        continue;
+                    }
+                    /* A definition: read its body as a term of its own, then go on
+                     * with the next term. */
+                    sgetc(src);
+                    if (!tsparse(src, &def)) {
+                        terror = "Unexpected end of input in definition.";
+                        def = NULL;
+                    }
+                    if (!def || !tdefine(name, length, def)) {
+                        workp = base;
+                        return true;
+                    }
+                    continue;
                 }
-            default:
-                abort();
-        }
-}
-
-static void rec(struct term_t * t, char v, const struct term_t * s, const struct bitmap * free_vars) {
-    struct term_t * pterm = t;
-    for (;;)
-        switch (pterm->type) {
-            case tlambda: {
-                    if (pterm->data.lambda_t.var == v)
-                        return;
-                    if (bitmapisset(free_vars, pterm->data.lambda_t.var)) {
-                        register char u;
-                        struct bitmap free_lambda_t = EMPTY_BITMAP;
-                        freevars(pterm->data.lambda_t.body, &free_lambda_t, empty_set);
-                        u = bitmapfresh(&free_lambda_t, free_vars);
-                        alpha(pterm->data.lambda_t.body, pterm->data.lambda_t.var, u);
-                        pterm->data.lambda_t.var = u;
+            case '#': {
+                    char name[NAME_SIZE];
+                    size_t length = 0;
+                    struct term_t * literal;
+                    while (isalnum(c = speek(src))) {
+                        if (length == sizeof(name)) {
+                            terror = "Name too long.";
+                            goto error;
+                        }
+                        name[length++] = sgetc(src);
                     }
-                    pterm = pterm->data.lambda_t.body;
+                    if (!(literal = tliteral(name, length)))
+                        goto error;
+                    pappend(literal);
                     continue;
                 }
-            case tapp: {
-                    rec(pterm->data.app_t.left, v, s, free_vars);
-                    pterm = pterm->data.app_t.right;
+            case '(': {
+                    depth++;
+                    wpush(NULL, NULL, NULL, pparen);
                     continue;
                 }
-            case tvariabl: {
-                    struct term_t * copy;
-                    if (pterm->data.var != v)
-                        return;
-                    *pterm = *(copy = tcparse(s));
-                    free(copy);
-                    return;
+            case ')': {
+                    struct term_t * paren;
+                    if (!depth) {
+                        terror = "Parenthesis mismatch.";
+                        goto error;
+                    }
+                    while (work[workp - 1].n >= plam)
+                        if (!plambda())
+                            goto error;
+                    if (!(paren = work[--workp].t)) {
+                        terror = "Invalid parenthesis content.";
+                        goto error;
+                    }
+                    depth--;
+                    pappend(paren);
+                    continue;
                 }
             default:
-                abort();
-        }
-}
-
-static bool isvalue(const struct term_t * pterm) {
-    return pterm->type == tlambda || pterm->type == tvariabl;
-}
-
-static char * nextapp(char * s, struct term_t ** t) {
-    struct term_t * left = NULL;
-    s = nextlambda(s, &left);
-    if (left) {
-        while (*s) {
-            struct term_t * right = NULL;
-            s = nextlambda(s, &right);
-            if (!right)
-                goto invalid;
-            else {
-                struct term_t * top = palloc();
-                top->type = tapp;
-                top->data.app_t.left = left;
-                top->data.app_t.right = right;
-                left = top;
-            }
+                pappend(pvar(c));
         }
     }
-invalid:
-    *t = left;
-    return s;
+    if (c == EOF && workp == base + 1 && !work[base].t) {
+        workp = base;
+        return false;
+    }
+    if (depth) {
+        terror = "Parenthesis mismatch.";
+        goto error;
+    }
+    while (workp > base + 1)
+        if (!plambda())
+            goto error;
+    *t = work[base].t;
+    workp = base;
+    return true;
+error:
+    /* Skip the rest of the term. */
+    while (c != EOF && (c != '\n' || depth > 0)) {
+        c = sgetc(src);
+        if (c == '(')
+            depth++;
+        else if (c == ')')
+            depth--;
+    }
+    workp = base;
+    return true;
 }
 
 struct term_t * tparse(char * s) {
-    struct term_t * t = NULL;
-    nextapp(s, &t);
-    return t;
+    struct source src;
+    struct term_t * t;
+    src.name = NULL;
+    src.line = src.column = 0;
+    src.p = s;
+    src.end = s + strlen(s);
+    src.fd = -1;
+    src.buf = NULL;
+    src.map = NULL;
+    return tsparse(&src, &t) ? t : NULL;
 }
 
 struct term_t * tcparse(const struct term_t * t) {
+    unsigned int base = workp;
     const struct term_t * pterm = t;
-    struct term_t * const ret = palloc();
-    struct term_t * p = ret;
-    for (;;)
-        switch ((p->type = pterm->type)) {
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        *slot = p = palloc();
+        STAT(copies);
+        if (ucharged)
+            ucharged->copies++;
+        switch ((*p = *pterm).type) {
             case tlambda: {
-                    p->data.lambda_t.var = pterm->data.lambda_t.var;
                     pterm = pterm->data.lambda_t.body;
-                    p = p->data.lambda_t.body = palloc();
+                    slot = &p->data.lambda_t.body;
                     continue;
                 }
             case tapp: {
-                    p->data.app_t.left = tcparse(pterm->data.app_t.left);
+                    wpush(NULL, &p->data.app_t.left, pterm->data.app_t.left, 0);
                     pterm = pterm->data.app_t.right;
-                    p = p->data.app_t.right = palloc();
+                    slot = &p->data.app_t.right;
                     continue;
                 }
-            case tvariabl: {
-                    p->data.var = pterm->data.var;
-                    return ret;
-                }
+            case tvariabl:
+            case tindex:
+            case tnumber:
+            case tprim:
+                break;
             default:
                 abort();
         }
+        if (workp == base)
+            return ret;
+        slot = work[--workp].slot;
+        pterm = work[workp].src;
+    }
 }
 
 void tfparse(struct term_t * t) {
+    unsigned int base = workp;
     struct term_t * pterm = t;
-    for (;;)
+    for (;;) {
         switch (pterm->type) {
                 struct term_t * tmp;
             case tlambda: {
                     tmp = pterm;
                     pterm = pterm->data.lambda_t.body;
-                    free(tmp);
+                    pfree(tmp);
                     continue;
                 }
             case tapp: {
-                    tfparse(pterm->data.app_t.left);
+                    wpush(pterm->data.app_t.left, NULL, NULL, 0);
                     tmp = pterm;
                     pterm = pterm->data.app_t.right;
-                    free(tmp);
+                    pfree(tmp);
                     continue;
                 }
-            case tvariabl: {
-                    free(pterm);
-                    return;
+            case tvariabl:
+            case tindex:
+            case tnumber:
+            case tprim: {
+                    pfree(pterm);
+                    break;
                 }
             default:
                 abort();
         }
+        if (workp == base)
+            return;
+        pterm = work[--workp].t;
+    }
+}
+
+static void oputc(int c, FILE * stream) {
+    if (outp == OUT_SIZE)
+        oflush(stream);
+    out[outp++] = c;
+}
+
+static void oputs(const char * s, FILE * stream) {
+    while (*s)
+        oputc(*s++, stream);
+}
+
+static void oindex(unsigned int index, FILE * stream) {
+    char digits[16];
+    sprintf(digits, "%u", index);
+    oputs(digits, stream);
+}
+
+static void oflush(FILE * stream) {
+    fwrite(out, 1, outp, stream);
+    outp = 0;
 }
 
 void tdparse(const struct term_t * t, FILE * stream) {
+    unsigned int base = workp;
     const struct term_t * pterm = t;
-    int nparen = 0;
-    for (;;)
+    unsigned int nparen = 0;
+    for (;;) {
         switch (pterm->type) {
             case tlambda: {
-                    fprintf(stream, "Lam (%c, ", pterm->data.lambda_t.var);
+                    oputs("Lam (", stream);
+                    oputc(pterm->data.lambda_t.var, stream);
+                    oputs(", ", stream);
                     pterm = pterm->data.lambda_t.body;
                     nparen++;
                     continue;
                 }
             case tapp: {
-                    fputs("@ (", stream);
-                    tdparse(pterm->data.app_t.left, stream);
-                    fputs(", ", stream);
-                    pterm = pterm->data.app_t.right;
-                    nparen++;
+                    /* The right operand closes this application and whatever was open. */
+                    oputs("@ (", stream);
+                    wpush(NULL, NULL, pterm->data.app_t.right, nparen + 1);
+                    pterm = pterm->data.app_t.left;
+                    nparen = 0;
                     continue;
                 }
             case tvariabl: {
-                    fputc(pterm->data.var, stream);
-                    goto Close_paren;
+                    oputc(pterm->data.var, stream);
+                    break;
+                }
+            case tindex: {
+                    oindex(pterm->data.index, stream);
+                    break;
+                }
+            case tnumber:
+            case tprim: {
+                    char name[NAME_SIZE];
+                    tlname(pterm, name);
+                    oputs(name, stream);
+                    break;
                 }
             default:
                 abort();
         }
-Close_paren:
-    while (nparen--)
-        fputc(')', stream);
-}
-
-void substart(void) {
-    unsigned int i = 0;
-    for (; i < sizeof(var_set_str) - 1; i++)
-        setbitmap(&var_set, var_set_str[i]);
-}
-
-void substitute(struct term_t * t, char v, const struct term_t * s) {
-    struct bitmap free_vars = EMPTY_BITMAP;
-    freevars(s, &free_vars, empty_set);
-    rec(t, v, s, &free_vars);
+        while (nparen--)
+            oputc(')', stream);
+        if (workp == base) {
+            oflush(stream);
+            return;
+        }
+        oputs(", ", stream);
+        pterm = work[--workp].src;
+        nparen = work[workp].n;
+    }
 }
 
-void evalbname(struct term_t ** ppterm) {
-    struct term_t ** stack[STACK_SIZE] = { ppterm };
-    int stackp = 0;
-    while (stackp >= 0) {
-        struct term_t * pterm = *stack[stackp];
-        switch (pterm->type) {
+/* Writes a term the way tsparse() reads it, with as few parentheses as that
+ * allows: applications nest to the left, and a lambda only needs parentheses when
+ * something follows it. A frame holds a right operand with the parentheses to
+ * close after it and whether it ends its group. */
+void tswrite(const struct term_t * t, FILE * stream) {
+    unsigned int base = workp, nparen = 0;
+    bool last = true;
+    for (;;) {
+        switch (t->type) {
             case tlambda: {
-                    stackp--;
+                    if (!last) {
+                        oputc('(', stream);
+                        nparen++;
+                        last = true;
+                    }
+                    oputc('\\', stream);
+                    oputc(t->data.lambda_t.var, stream);
+                    oputc(' ', stream);
+                    t = t->data.lambda_t.body;
                     continue;
                 }
-            case tvariabl: {
-                    return;
-                }
             case tapp: {
-                    if (pterm->data.app_t.left->type == tlambda) {
-                        struct term_t * lambda_t = pterm->data.app_t.left;
-                        substitute(lambda_t->data.lambda_t.body, lambda_t->data.lambda_t.var,
-                                   pterm->data.app_t.right);
-                        *stack[stackp] = lambda_t->data.lambda_t.body;
-                        tfparse(pterm->data.app_t.right);
-                        free(pterm);
-                        free(lambda_t);
-                        continue;
-                    }
-                    if (++stackp >= STACK_SIZE) {
-                        puts("Stack overflow.");
-                        return;
-                    }
-                    stack[stackp] = &pterm->data.app_t.left;
+                    wpush(NULL, NULL, t->data.app_t.right, nparen << 1 | last);
+                    t = t->data.app_t.left;
+                    nparen = 0;
+                    last = false;
                     continue;
                 }
+            case tvariabl: {
+                    oputc(t->data.var, stream);
+                    break;
+                }
+            case tindex: {
+                    oindex(t->data.index, stream);
+                    break;
+                }
+            case tnumber:
+            case tprim: {
+                    char name[NAME_SIZE];
+                    tlname(t, name);
+                    oputs(name, stream);
+                    break;
+                }
             default:
                 abort();
         }
+        while (nparen--)
+            oputc(')', stream);
+        if (workp == base) {
+            oflush(stream);
+            return;
+        }
+        oputc(' ', stream);
+        t = work[--workp].src;
+        nparen = work[workp].n >> 1;
+        last = work[workp].n & 1;
+        if (t->type == tapp) {
+            oputc('(', stream);
+            nparen++;
+            last = true;
+        }
     }
 }
 
-void evalbvalue(struct term_t ** ppterm) {
-    struct term_t ** stack[STACK_SIZE] = { ppterm };
-    int stackp = 0;
-    while (stackp >= 0) {
-        struct term_t * pterm = *stack[stackp];
+/* Binary terms are Tromp's binary lambda calculus: 00 M is a lambda, 01 M N an
+ * application and n + 1 ones followed by a zero stand for index n. A term is
+ * preceded by a byte counting its free variables and their names, and free
+ * variable i is written as if bound by i more lambdas around the term. Bits are
+ * packed most significant first and every term is padded to a whole byte. */
+static int bget(struct source * src, struct bits * b) {
+    if (!b->n) {
+        int c = sgetc(src);
+        if (c == EOF)
+            return EOF;
+        b->byte = c;
+        b->n = 8;
+    }
+    return b->byte >> --b->n & 1;
+}
+
+static void bput(struct bits * b, int bit, FILE * stream) {
+    b->byte = b->byte << 1 | bit;
+    if (++b->n == 8) {
+        fputc(b->byte, stream);
+        b->byte = b->n = 0;
+    }
+}
+
+static void bindex(struct bits * b, unsigned int index, FILE * stream) {
+    do
+        bput(b, 1, stream);
+    while (index--);
+    bput(b, 0, stream);
+}
+
+/* Reads a binary term like tsparse() reads a text one. Binders are named after
+ * their depth, and tnamed() sorts out clashes with the free variables. */
+bool tbparse(struct source * src, struct term_t ** t) {
+    unsigned int base = workp, nfree, i;
+    char names[256];
+    struct bits b = { 0, 0 };
+    int c, bit;
+    *t = NULL;
+    if ((c = sgetc(src)) == EOF)
+        return false;
+    nfree = c;
+    for (i = 0; i < nfree; i++) {
+        if ((c = sgetc(src)) == EOF)
+            goto truncated;
+        names[i] = c;
+    }
+    wpush(NULL, t, NULL, 0);
+    while (workp > base) {
+        struct term_t ** slot = work[--workp].slot, * p;
+        unsigned int depth = work[workp].n;
+        if ((bit = bget(src, &b)) == EOF)
+            goto truncated;
+        *slot = p = palloc();
+        if (bit) {
+            unsigned int index = 0;
+            while ((bit = bget(src, &b)) == 1)
+                index++;
+            if (bit == EOF)
+                goto truncated;
+            if (index < depth) {
+                p->type = tindex;
+                p->data.index = index;
+            } else if (index - depth < nfree) {
+                p->type = tvariabl;
+                p->data.var = names[index - depth];
+            } else {
+                terror = "Unbound index in binary term.";
+                goto error;
+            }
+            continue;
+        }
+        if ((bit = bget(src, &b)) == EOF)
+            goto truncated;
+        if (bit) {
+            p->type = tapp;
+            wpush(NULL, &p->data.app_t.right, NULL, depth);
+            wpush(NULL, &p->data.app_t.left, NULL, depth);
+        } else {
+            p->type = tlambda;
+            p->data.lambda_t.var = var_set_str[depth % (sizeof(var_set_str) - 1)];
+            wpush(NULL, &p->data.lambda_t.body, NULL, depth + 1);
+        }
+    }
+    tnamed(*t);
+    return true;
+truncated:
+    terror = "Unexpected end of binary input.";
+error:
+    workp = base;
+    *t = NULL;
+    return true;
+}
+
+void tbwrite(struct term_t * t, FILE * stream) {
+    unsigned int base = workp, nfree = 0, slot[256] = { 0 };
+    char names[256];
+    const struct term_t * pterm;
+    struct bits b = { 0, 0 };
+    tchurch(t, -1UL);
+    tdbruijn(t);
+    /* Number the free variables in the order they are written in. */
+    wpush(NULL, NULL, t, 0);
+    while (workp > base) {
+        pterm = work[--workp].src;
         switch (pterm->type) {
+            case tlambda:
+                wpush(NULL, NULL, pterm->data.lambda_t.body, 0);
+                break;
+            case tapp:
+                wpush(NULL, NULL, pterm->data.app_t.right, 0);
+                wpush(NULL, NULL, pterm->data.app_t.left, 0);
+                break;
             case tvariabl:
+                if (!slot[(unsigned char) pterm->data.var]) {
+                    names[nfree] = pterm->data.var;
+                    slot[(unsigned char) pterm->data.var] = ++nfree;
+                }
+                break;
+        }
+    }
+    fputc(nfree, stream);
+    fwrite(names, 1, nfree, stream);
+    wpush(NULL, NULL, t, 0);
+    while (workp > base) {
+        unsigned int depth = work[--workp].n;
+        pterm = work[workp].src;
+        switch (pterm->type) {
             case tlambda: {
-                    stackp--;
-                    continue;
+                    bput(&b, 0, stream);
+                    bput(&b, 0, stream);
+                    wpush(NULL, NULL, pterm->data.lambda_t.body, depth + 1);
+                    break;
                 }
             case tapp: {
-                    if (isvalue(pterm->data.app_t.right)) {
-                        struct term_t * lambda_t = pterm->data.app_t.left;
-                        if (lambda_t->type != tlambda) {
-                            if (lambda_t->type == tvariabl)
-                                return;
-                            if (++stackp >= STACK_SIZE) {
-                                puts("Stack overflow.");
-                                return;
-                            }
-                            stack[stackp] = &pterm->data.app_t.left;
-                            continue;
-                        }
-                        substitute(lambda_t->data.lambda_t.body, lambda_t->data.lambda_t.var,
-                                   pterm->data.app_t.right);
-                        *stack[stackp] = lambda_t->data.lambda_t.body;
-                        tfparse(pterm->data.app_t.right);
-                        free(pterm);
-                        free(lambda_t);
-                        continue;
-                    }
-                    if (++stackp >= STACK_SIZE) {
-                        puts("Stack overflow.");
-                        return;
+                    bput(&b, 0, stream);
+                    bput(&b, 1, stream);
+                    wpush(NULL, NULL, pterm->data.app_t.right, depth);
+                    wpush(NULL, NULL, pterm->data.app_t.left, depth);
+                    break;
+                }
+            case tvariabl: {
+                    bindex(&b, depth + slot[(unsigned char) pterm->data.var] - 1, stream);
+                    break;
+                }
+            case tindex: {
+                    bindex(&b, pterm->data.index, stream);
+                    break;
+                }
+            default:
+                abort();
+        }
+    }
+    while (b.n)
+        bput(&b, 0, stream);
+    tnamed(t);
+}
+
+unsigned int * tpack(const struct term_t * t, size_t * n) {
+    unsigned int base = workp, * words = NULL, w[3], k, i;
+    size_t size = 0;
+    *n = 0;
+    wpush(NULL, NULL, t, 0);
+    while (workp > base) {
+        t = work[--workp].src;
+        switch (t->type) {
+            case tlambda: {
+                    w[0] = (unsigned int) (unsigned char) t->data.lambda_t.var << 2 | wlam;
+                    k = 1;
+                    wpush(NULL, NULL, t->data.lambda_t.body, 0);
+                    break;
+                }
+            case tapp: {
+                    w[0] = wapp;
+                    k = 1;
+                    wpush(NULL, NULL, t->data.app_t.right, 0);
+                    wpush(NULL, NULL, t->data.app_t.left, 0);
+                    break;
+                }
+            case tindex: {
+                    w[0] = t->data.index << 2 | widx;
+                    k = 1;
+                    break;
+                }
+            case tvariabl: {
+                    w[0] = (unsigned int) (unsigned char) t->data.var << 2 | wvar;
+                    k = 1;
+                    break;
+                }
+            case tnumber: {
+                    w[0] = WNUMBER;
+                    w[1] = t->data.number & 0xFFFFFFFFUL;
+                    w[2] = t->data.number >> 16 >> 16;
+                    k = 3;
+                    break;
+                }
+            case tprim: {
+                    w[0] = WPRIM(t->data.prim);
+                    k = 1;
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (*n + k > size) {
+            size = size ? size * 2 : 64;
+            if (!(words = realloc(words, size * sizeof(*words))))
+                tnomem();
+        }
+        for (i = 0; i < k; i++)
+            words[(*n)++] = w[i];
+    }
+    return words;
+}
+
+struct term_t * tunpack(const unsigned int * w) {
+    unsigned int base = workp;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;; w++) {
+        *slot = p = palloc();
+        switch (*w & 3) {
+            case wlam: {
+                    p->type = tlambda;
+                    p->data.lambda_t.var = *w >> 2;
+                    slot = &p->data.lambda_t.body;
+                    continue;
+                }
+            case wapp: {
+                    p->type = tapp;
+                    wpush(NULL, &p->data.app_t.right, NULL, 0);
+                    slot = &p->data.app_t.left;
+                    continue;
+                }
+            case widx: {
+                    p->type = tindex;
+                    p->data.index = *w >> 2;
+                    break;
+                }
+            default: {
+                    if (*w == WNUMBER) {
+                        p->type = tnumber;
+                        p->data.number = (unsigned long) w[2] << 16 << 16 | w[1];
+                        w += 2;
+                    } else if (*w >> 2 > 256) {
+                        p->type = tprim;
+                        p->data.prim = (*w >> 2) - 257;
+                    } else {
+                        p->type = tvariabl;
+                        p->data.var = *w >> 2;
                     }
-                    stack[stackp] = &pterm->data.app_t.right;
+                }
+        }
+        if (workp == base)
+            return ret;
+        slot = work[--workp].slot;
+    }
+}
+
+static void pushbinder(struct scope * sc, char name) {
+    if (sc->depth == sc->size) {
+        sc->size = sc->size ? sc->size * 2 : 64;
+        if (!(sc->binders = realloc(sc->binders, sc->size * sizeof(*sc->binders))))
+            tnomem();
+    }
+    sc->binders[sc->depth++].name = name;
+}
+
+static void dindex(struct term_t * t, struct scope * sc) {
+    unsigned int base = workp;
+    struct term_t * pterm = t;
+    for (;;) {
+        switch (pterm->type) {
+            case tlambda: {
+                    unsigned char c = pterm->data.lambda_t.var;
+                    pushbinder(sc, c);
+                    sc->binders[sc->depth - 1].shadowed = sc->level[c];
+                    sc->level[c] = sc->depth;
+                    wpush(NULL, NULL, NULL, 1);
+                    pterm = pterm->data.lambda_t.body;
                     continue;
                 }
+            case tapp: {
+                    wpush(pterm->data.app_t.left, NULL, NULL, 0);
+                    pterm = pterm->data.app_t.right;
+                    continue;
+                }
+            case tvariabl: {
+                    unsigned int level = sc->level[(unsigned char) pterm->data.var];
+                    if (level) {
+                        pterm->type = tindex;
+                        pterm->data.index = sc->depth - level;
+                    }
+                    break;
+                }
+            case tindex:
+            case tnumber:
+            case tprim:
+                break;
             default:
                 abort();
         }
+        /* Frames with n set mark the end of a binder's scope. */
+        for (;;) {
+            struct binder * b;
+            if (workp == base)
+                return;
+            if (!work[--workp].n)
+                break;
+            b = &sc->binders[--sc->depth];
+            sc->level[(unsigned char) b->name] = b->shadowed;
+        }
+        pterm = work[workp].t;
     }
 }
 
-void evaldeep(struct term_t ** ppterm) {
-    while (1) {
-        struct term_t * pterm = *ppterm;
+/* Collects the names that occurrences in t refer to outside of it, assuming t sits
+ * under sc->depth + 1 binders of which the innermost one hasn't been named yet. */
+static void dused(const struct term_t * t, const struct scope * sc, unsigned int inner, struct bitmap * used) {
+    unsigned int base = workp;
+    const struct term_t * pterm = t;
+    for (;;) {
         switch (pterm->type) {
+            case tlambda: {
+                    inner++;
+                    pterm = pterm->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    wpush(NULL, NULL, pterm->data.app_t.left, inner);
+                    pterm = pterm->data.app_t.right;
+                    continue;
+                }
             case tvariabl: {
-                    return;
+                    setbitmap(used, pterm->data.var);
+                    break;
                 }
+            case tindex: {
+                    if (pterm->data.index > inner)
+                        setbitmap(used, sc->binders[sc->depth + inner - pterm->data.index].name);
+                    break;
+                }
+            case tnumber:
+            case tprim:
+                break;
+            default:
+                abort();
+        }
+        if (workp == base)
+            return;
+        pterm = work[--workp].src;
+        inner = work[workp].n;
+    }
+}
+
+/* Whether a node past pos and below the lambda at pos has key k. The positions
+ * asked about only ever grow, so next[k] only ever moves forward. */
+static bool dusing(struct occurs * o, unsigned int k, unsigned int pos) {
+    unsigned int * i = &o->next[k];
+    while (*i < o->first[k + 1] && o->at[*i] <= pos)
+        ++*i;
+    return *i < o->first[k + 1] && o->at[*i] <= o->last[pos];
+}
+
+static void dkey(struct occurs * o, unsigned int k, unsigned int pos, bool fill) {
+    if (fill)
+        o->at[o->next[k]++] = pos;
+    else
+        o->first[k + 1]++;
+}
+
+/* Counts the occurrences of every key in t, or with fill set, lists where they
+ * are. Returns the number of nodes. */
+static unsigned int dwalk(const struct term_t * t, struct occurs * o, bool fill) {
+    unsigned int base = workp, pos = 0, depth = 0;
+    const struct term_t * pterm = t;
+    for (;;) {
+        switch (pterm->type) {
             case tlambda: {
-                    evaldeep(&pterm->data.lambda_t.body);
-                    return;
+                    if (!fill && 256 + ++depth >= o->keys) {
+                        unsigned int keys = o->keys * 2;
+                        if (!(o->first = realloc(o->first, (keys + 1) * sizeof(*o->first))))
+                            tnomem();
+                        memset(o->first + o->keys + 1, 0, (keys - o->keys) * sizeof(*o->first));
+                        o->keys = keys;
+                    } else if (fill)
+                        depth++;
+                    wpush(NULL, NULL, NULL, ++pos);
+                    pterm = pterm->data.lambda_t.body;
+                    continue;
                 }
             case tapp: {
-                    struct term_t * left;
-                    evaldeep(&pterm->data.app_t.left);
-                    left = pterm->data.app_t.left;
-                    evaldeep(&pterm->data.app_t.right);
-                    if (left->type == tlambda) {
-                        evalbname(ppterm);
+                    wpush(NULL, NULL, pterm->data.app_t.left, 0);
+                    pos++;
+                    pterm = pterm->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+                dkey(o, (unsigned char) pterm->data.var, pos, fill);
+                break;
+            case tindex:
+                if (pterm->data.index < depth)
+                    dkey(o, 256 + depth - 1 - pterm->data.index, pos, fill);
+                break;
+            case tnumber:
+            case tprim:
+                break;
+            default:
+                abort();
+        }
+        pos++;
+        for (;;) {
+            if (workp == base)
+                return pos;
+            if (!work[--workp].n)
+                break;
+            depth--;
+            if (fill)
+                o->last[work[workp].n - 1] = pos - 1;
+        }
+        pterm = work[workp].src;
+    }
+}
+
+/* Names the binders of t after their hints, unless that would capture one of the
+ * occurrences below them. References from below a binder to a binder named the
+ * same above it are renamed away from, so only the innermost binder of a name may
+ * be captured, and o tells whether that, or the free variable of that name, is. */
+static void dname(struct term_t * t, struct scope * sc, struct occurs * o) {
+    unsigned int base = workp, pos = 0;
+    struct term_t * pterm = t;
+    for (;;) {
+        switch (pterm->type) {
+            case tlambda: {
+                    char c = pterm->data.lambda_t.var;
+                    unsigned int level = sc->level[(unsigned char) c];
+                    if ((level && dusing(o, 256 + level - 1, pos))
+                     || (bitmapisset(&sc->free_vars, c) && dusing(o, (unsigned char) c, pos))) {
+                        struct bitmap used = EMPTY_BITMAP;
+                        dused(pterm->data.lambda_t.body, sc, 0, &used);
+                        c = bitmapfresh(&used, &empty_set);
+                    }
+                    pterm->data.lambda_t.var = c;
+                    pushbinder(sc, c);
+                    sc->binders[sc->depth - 1].shadowed = sc->level[(unsigned char) c];
+                    sc->level[(unsigned char) c] = sc->depth;
+                    wpush(NULL, NULL, NULL, 1);
+                    pos++;
+                    pterm = pterm->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    wpush(pterm->data.app_t.left, NULL, NULL, 0);
+                    pos++;
+                    pterm = pterm->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+            case tnumber:
+            case tprim:
+                break;
+            case tindex: {
+                    pterm->type = tvariabl;
+                    pterm->data.var = sc->binders[sc->depth - 1 - pterm->data.index].name;
+                    break;
+                }
+            default:
+                abort();
+        }
+        pos++;
+        for (;;) {
+            struct binder * b;
+            if (workp == base)
+                return;
+            if (!work[--workp].n)
+                break;
+            b = &sc->binders[--sc->depth];
+            sc->level[(unsigned char) b->name] = b->shadowed;
+        }
+        pterm = work[workp].t;
+    }
+}
+
+static struct term_t * dcopy(const struct term_t * t, unsigned int shift, unsigned int cutoff) {
+    unsigned int base = workp;
+    const struct term_t * pterm = t;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        *slot = p = palloc();
+        STAT(copies);
+        switch ((*p = *pterm).type) {
+            case tlambda: {
+                    pterm = pterm->data.lambda_t.body;
+                    slot = &p->data.lambda_t.body;
+                    cutoff++;
+                    continue;
+                }
+            case tapp: {
+                    wpush(NULL, &p->data.app_t.left, pterm->data.app_t.left, cutoff);
+                    pterm = pterm->data.app_t.right;
+                    slot = &p->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+            case tnumber:
+            case tprim:
+                break;
+            case tindex: {
+                    if (p->data.index >= cutoff)
+                        p->data.index += shift;
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (workp == base)
+            return ret;
+        slot = work[--workp].slot;
+        pterm = work[workp].src;
+        cutoff = work[workp].n;
+    }
+}
+
+static void dsubst(struct term_t * t, unsigned int depth, const struct term_t * s) {
+    unsigned int base = workp;
+    struct term_t * pterm = t;
+    for (;;) {
+        switch (pterm->type) {
+            case tlambda: {
+                    depth++;
+                    pterm = pterm->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    wpush(pterm->data.app_t.left, NULL, NULL, depth);
+                    pterm = pterm->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+            case tnumber:
+            case tprim:
+                break;
+            case tindex: {
+                    struct term_t * copy;
+                    if (pterm->data.index > depth)
+                        pterm->data.index--;
+                    else if (pterm->data.index == depth) {
+                        *pterm = *(copy = dcopy(s, depth, 0));
+                        pfree(copy);
+                    }
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (workp == base)
+            return;
+        pterm = work[--workp].t;
+        depth = work[workp].n;
+    }
+}
+
+void tdbruijn(struct term_t * t) {
+    struct scope sc = { NULL };
+    dindex(t, &sc);
+    free(sc.binders);
+}
+
+void tnamed(struct term_t * t) {
+    struct scope sc = { NULL };
+    struct occurs o = { NULL };
+    unsigned int k, nodes;
+    dused(t, &sc, 0, &sc.free_vars);
+    o.keys = 512;
+    if (!(o.first = calloc(o.keys + 1, sizeof(*o.first))))
+        tnomem();
+    nodes = dwalk(t, &o, false);
+    for (k = 0; k < o.keys; k++)
+        o.first[k + 1] += o.first[k];
+    o.next = malloc(o.keys * sizeof(*o.next));
+    o.at = malloc((o.first[o.keys] + 1) * sizeof(*o.at));
+    o.last = malloc(nodes * sizeof(*o.last));
+    if (!o.next || !o.at || !o.last)
+        tnomem();
+    memcpy(o.next, o.first, o.keys * sizeof(*o.next));
+    dwalk(t, &o, true);
+    memcpy(o.next, o.first, o.keys * sizeof(*o.next));
+    dname(t, &sc, &o);
+    free(o.first);
+    free(o.next);
+    free(o.at);
+    free(o.last);
+    free(sc.binders);
+    freevars(t);
+}
+
+void substitute(struct term_t * t, char v, const struct term_t * s) {
+    STAT(substs);
+    rec(t, v, s, false);
+}
+
+static void nbeta(struct term_t * lambda_t, const struct term_t * s) {
+    STAT(betas);
+    if (uprofiling)
+        ucharge(lambda_t->origin);
+    substitute(lambda_t->data.lambda_t.body, lambda_t->data.lambda_t.var, s);
+    ucharged = NULL;
+}
+
+static void dbeta(struct term_t * lambda_t, const struct term_t * s) {
+    STAT(betas);
+    STAT(substs);
+    dsubst(lambda_t->data.lambda_t.body, 0, s);
+}
+
+/* Counts the free occurrences of v up to two, and tells whether the last one found
+ * is under a lambda. Frames hold a left operand and whether it is under one. */
+static unsigned int occurs(const struct term_t * t, char v, bool * under) {
+    unsigned int base = workp, n = 0;
+    bool in = false;
+    for (;;) {
+        if (bitmapisset(&t->free_vars, v))
+            switch (t->type) {
+                case tlambda: {
+                        if (t->data.lambda_t.var == v)
+                            break;
+                        t = t->data.lambda_t.body;
+                        in = true;
+                        continue;
+                    }
+                case tapp: {
+                        wpush(NULL, NULL, t->data.app_t.left, in);
+                        t = t->data.app_t.right;
                         continue;
                     }
+                case tvariabl: {
+                        if (t->data.var != v)
+                            break;
+                        if (++n == 2) {
+                            workp = base;
+                            return n;
+                        }
+                        *under = in;
+                        break;
+                    }
+                default:
+                    break;
+            }
+        if (workp == base)
+            return n;
+        t = work[--workp].src;
+        in = work[workp].n;
+    }
+}
+
+/* A value or a variable applied to something, which every evaluator leaves alone. */
+static bool neutral(const struct term_t * t) {
+    if (isvalue(t))
+        return true;
+    while (t->type == tapp)
+        t = t->data.app_t.left;
+    return t->type == tvariabl;
+}
+
+/* Rewrites the term in slot once if it is \x M x with M neutral and x not free in M
+ * (eta), or a redex (\x B) A using x once (linear) or not at all (dead). A linear
+ * redex moves A into B, which never duplicates work as long as A is a value or x
+ * isn't under a lambda of B. A dead one drops A, which call-by-value only may do
+ * to a value. Each rewrite shrinks the term. */
+static bool simplify(struct term_t ** slot, bool strict) {
+    struct term_t * t = *slot, * left, * right;
+    bool under = false;
+    if (t->type == tlambda) {
+        struct term_t * body = t->data.lambda_t.body;
+        if (body->type != tapp)
+            return false;
+        left = body->data.app_t.left;
+        right = body->data.app_t.right;
+        if (right->type != tvariabl || right->data.var != t->data.lambda_t.var
+         || bitmapisset(&left->free_vars, right->data.var) || !neutral(left))
+            return false;
+        STAT(etas);
+        *slot = left;
+        pfree(right);
+        pfree(body);
+        pfree(t);
+        return true;
+    }
+    if (t->type != tapp || (left = t->data.app_t.left)->type != tlambda)
+        return false;
+    right = t->data.app_t.right;
+    switch (occurs(left->data.lambda_t.body, left->data.lambda_t.var, &under)) {
+        case 0: {
+                if (strict && !isvalue(right))
+                    return false;
+                STAT(drops);
+                tfparse(right);
+                break;
+            }
+        case 1: {
+                if (under && !isvalue(right))
+                    return false;
+                STAT(inlines);
+                rec(left->data.lambda_t.body, left->data.lambda_t.var, right, true);
+                pfree(right);
+                break;
+            }
+        default:
+            return false;
+    }
+    *slot = left->data.lambda_t.body;
+    pfree(left);
+    pfree(t);
+    return true;
+}
+
+/* Simplifies the term bottom up, going over it again until nothing changes, and
+ * leaves its free variable sets exact. A frame with n = 1 has its operands done and
+ * is simplified until it no longer changes. */
+void toptimize(struct term_t ** ppterm, bool strict) {
+    bool changed;
+    freevars(*ppterm);
+    do {
+        unsigned int base = workp;
+        changed = false;
+        wpush(NULL, ppterm, NULL, 0);
+        while (workp > base) {
+            struct term_t ** slot = work[workp - 1].slot, * pterm = *slot;
+            if (!work[workp - 1].n) {
+                work[workp - 1].n = 1;
+                if (pterm->type == tlambda)
+                    wpush(NULL, &pterm->data.lambda_t.body, NULL, 0);
+                else if (pterm->type == tapp) {
+                    wpush(NULL, &pterm->data.app_t.left, NULL, 0);
+                    wpush(NULL, &pterm->data.app_t.right, NULL, 0);
+                }
+                continue;
+            }
+            if (simplify(slot, strict)) {
+                changed = true;
+                continue;
+            }
+            workp--;
+        }
+    } while (changed);
+    freevars(*ppterm);
+}
+
+/* Turns a native integer about to be applied into its Church numeral. */
+static void bnumeral(struct term_t ** slot, beta_t beta) {
+    struct term_t * t = *slot;
+    if (t->type == tnumber) {
+        *slot = tnumeral(t->data.number, beta == dbeta);
+        pfree(t);
+    }
+}
+
+/* Normalizes the operands of a saturated primitive application and applies it,
+ * returning like tprimitive(). The weak evaluators recurse into deep() here. */
+static int bprimitive(struct term_t ** slot, beta_t beta) {
+    struct term_t * t;
+    for (t = *slot; t->type == tapp; t = t->data.app_t.left) {
+        deep(&t->data.app_t.right, beta);
+        if (tresult != rnormal)
+            return -1;
+    }
+    return tprimitive(slot, beta == dbeta);
+}
+
+/* A strict caller has every operand normalized before it is substituted, so that
+ * it is not normalized again in each copy. */
+static void bname(struct term_t ** ppterm, beta_t beta, bool strict) {
+    unsigned int base = workp;
+    wpush(NULL, ppterm, NULL, 0);
+    while (workp > base) {
+        struct term_t ** slot = work[workp - 1].slot, * pterm = *slot;
+        switch (pterm->type) {
+            case tlambda:
+            case tnumber: {
+                    workp--;
+                    continue;
+                }
+            case tvariabl:
+            case tindex:
+            case tprim: {
+                    workp = base;
                     return;
                 }
+            case tapp: {
+                    if (tsaturated(pterm)) {
+                        if (bprimitive(slot, beta) <= 0) {
+                            workp = base;
+                            return;
+                        }
+                        continue;
+                    }
+                    bnumeral(&pterm->data.app_t.left, beta);
+                    if (pterm->data.app_t.left->type == tlambda) {
+                        struct term_t * lambda_t = pterm->data.app_t.left;
+                        if (strict)
+                            deep(&pterm->data.app_t.right, beta);
+                        if (tresult != rnormal || !tspend()) {
+                            workp = base;
+                            return;
+                        }
+                        beta(lambda_t, pterm->data.app_t.right);
+                        *slot = lambda_t->data.lambda_t.body;
+                        tfparse(pterm->data.app_t.right);
+                        pfree(pterm);
+                        pfree(lambda_t);
+                        continue;
+                    }
+                    wpush(NULL, &pterm->data.app_t.left, NULL, 0);
+                    STATMAX(spine, workp - base);
+                    continue;
+                }
             default:
                 abort();
         }
     }
 }
 
+static void bvalue(struct term_t ** ppterm, beta_t beta) {
+    unsigned int base = workp;
+    wpush(NULL, ppterm, NULL, 0);
+    while (workp > base) {
+        struct term_t ** slot = work[workp - 1].slot, * pterm = *slot;
+        switch (pterm->type) {
+            case tvariabl:
+            case tindex:
+            case tlambda:
+            case tnumber:
+            case tprim: {
+                    workp--;
+                    continue;
+                }
+            case tapp: {
+                    if (tsaturated(pterm)) {
+                        if (bprimitive(slot, beta) <= 0) {
+                            workp = base;
+                            return;
+                        }
+                        continue;
+                    }
+                    if (isvalue(pterm->data.app_t.right)) {
+                        struct term_t * lambda_t;
+                        bnumeral(&pterm->data.app_t.left, beta);
+                        if ((lambda_t = pterm->data.app_t.left)->type != tlambda) {
+                            if (lambda_t->type == tvariabl || lambda_t->type == tindex || lambda_t->type == tprim) {
+                                workp = base;
+                                return;
+                            }
+                            wpush(NULL, &pterm->data.app_t.left, NULL, 0);
+                            STATMAX(spine, workp - base);
+                            continue;
+                        }
+                        if (!tspend()) {
+                            workp = base;
+                            return;
+                        }
+                        beta(lambda_t, pterm->data.app_t.right);
+                        *slot = lambda_t->data.lambda_t.body;
+                        tfparse(pterm->data.app_t.right);
+                        pfree(pterm);
+                        pfree(lambda_t);
+                        continue;
+                    }
+                    wpush(NULL, &pterm->data.app_t.right, NULL, 0);
+                    STATMAX(spine, workp - base);
+                    continue;
+                }
+            default:
+                abort();
+        }
+    }
+}
+
+/* Frames step through n = 0 (look at the term), 1 (left operand normalized) and
+ * 2 (both operands normalized), or 3 instead of 1 if the right operand was spawned.
+ * A closed redex missing from the normal form cache gets n = 4 and is reduced by
+ * a frame with n = 5, which doesn't look it up again; the normal form is stored
+ * once that frame is done. */
+static void deep(struct term_t ** ppterm, beta_t beta) {
+    unsigned int base = workp, mark = mpending();
+    if (team && !pool && tsize(*ppterm) == CUTOFF && pdeep(ppterm, beta))
+        return;
+    wpush(NULL, ppterm, NULL, 0);
+    while (workp > base) {
+        struct term_t ** slot = work[workp - 1].slot, * pterm = *slot;
+        switch (work[workp - 1].n) {
+            case 0:
+                switch (pterm->type) {
+                    case tvariabl:
+                    case tindex:
+                    case tnumber:
+                    case tprim: {
+                            workp--;
+                            continue;
+                        }
+                    case tlambda: {
+                            work[workp - 1].slot = &pterm->data.lambda_t.body;
+                            continue;
+                        }
+                    case tapp: {
+                            work[workp - 1].n = pool && pspawn(pterm) ? 3 : 1;
+                            wpush(NULL, &pterm->data.app_t.left, NULL, 0);
+                            continue;
+                        }
+                    default:
+                        abort();
+                }
+            case 3:
+                if (pjoin()) {
+                    if (pool->halt) {
+                        tresult = pool->halt;
+                        mabandon(mark);
+                        workp = base;
+                        return;
+                    }
+                    work[workp - 1].n = 2;
+                    continue;
+                }
+                /* Nobody took the right operand, normalize it here. */
+                /* FALLTHROUGH */
+            case 1: {
+                    work[workp - 1].n = 2;
+                    wpush(NULL, &pterm->data.app_t.right, NULL, 0);
+                    continue;
+                }
+            case 4: {
+                    mrecord(pterm);
+                    workp--;
+                    continue;
+                }
+            default: {
+                    bnumeral(&pterm->data.app_t.left, beta);
+                    if (pterm->data.app_t.left->type == tlambda) {
+                        if (work[workp - 1].n == 2 && beta == nbeta && !memcmp(&pterm->free_vars, &empty_set, sizeof(empty_set)))
+                            switch (mlookup(slot)) {
+                                case 1:
+                                    workp--;
+                                    continue;
+                                case 0:
+                                    work[workp - 1].n = 4;
+                                    wpush(NULL, slot, NULL, 5);
+                                    continue;
+                            }
+                        work[workp - 1].n = 0;
+                        bname(slot, beta, false);
+                        if (tresult != rnormal) {
+                            mabandon(mark);
+                            workp = base;
+                            return;
+                        }
+                        continue;
+                    }
+                    if (tsaturated(pterm) && tprimitive(slot, beta == dbeta) < 0) {
+                        mabandon(mark);
+                        workp = base;
+                        return;
+                    }
+                    workp--;
+                    continue;
+                }
+        }
+    }
+}
+
+/* Reduces a term about to be written to weak head normal form by name, first
+ * handing what was written so far to the stream if there is a redex to work on.
+ * Operands are left alone until they are written in turn, so the head is found in
+ * normal order and never changes once written. Once the budget is spent the rest
+ * is written as it is. */
+static void shead(struct term_t ** slot, FILE * stream) {
+    const struct term_t * h = *slot;
+    if (tresult != rnormal)
+        return;
+    while (h->type == tapp)
+        h = h->data.app_t.left;
+    if (h != *slot && h->type != tvariabl && h->type != tindex) {
+        oflush(stream);
+        fflush(stream);
+    }
+    bname(slot, nbeta, false);
+}
+
+/* Walks the term like tdparse() and tswrite() do, with frames holding the right
+ * operands and nparen << 1 | last, except that every subterm is brought to weak
+ * head normal form before it is looked at. The spine below a head is stuck and
+ * needs no more reduction on the way down. */
+void tstream(struct term_t * t, bool plain, FILE * stream) {
+    unsigned int base = workp, nparen = 0;
+    bool last = true;
+    tresult = rnormal;
+    shead(&t, stream);
+    for (;;) {
+        struct term_t * next;
+        switch (t->type) {
+            case tlambda: {
+                    if (plain) {
+                        if (!last) {
+                            oputc('(', stream);
+                            nparen++;
+                            last = true;
+                        }
+                        oputc('\\', stream);
+                        oputc(t->data.lambda_t.var, stream);
+                        oputc(' ', stream);
+                    } else {
+                        oputs("Lam (", stream);
+                        oputc(t->data.lambda_t.var, stream);
+                        oputs(", ", stream);
+                        nparen++;
+                    }
+                    next = t->data.lambda_t.body;
+                    pfree(t);
+                    t = next;
+                    shead(&t, stream);
+                    continue;
+                }
+            case tapp: {
+                    if (!plain)
+                        oputs("@ (", stream);
+                    wpush(t->data.app_t.right, NULL, NULL, plain ? nparen << 1 | last : (nparen + 1) << 1);
+                    next = t->data.app_t.left;
+                    pfree(t);
+                    t = next;
+                    nparen = 0;
+                    last = false;
+                    continue;
+                }
+            case tvariabl: {
+                    oputc(t->data.var, stream);
+                    break;
+                }
+            case tindex: {
+                    oindex(t->data.index, stream);
+                    break;
+                }
+            case tnumber:
+            case tprim: {
+                    char name[NAME_SIZE];
+                    tlname(t, name);
+                    oputs(name, stream);
+                    break;
+                }
+            default:
+                abort();
+        }
+        pfree(t);
+        while (nparen--)
+            oputc(')', stream);
+        if (workp == base) {
+            oflush(stream);
+            return;
+        }
+        oputs(plain ? " " : ", ", stream);
+        t = work[--workp].t;
+        nparen = work[workp].n >> 1;
+        last = work[workp].n & 1;
+        shead(&t, stream);
+        if (plain && t->type == tapp) {
+            oputc('(', stream);
+            nparen++;
+            last = true;
+        }
+    }
+}
+
+/* Counts the nodes of a term, stopping at CUTOFF. */
+static unsigned int tsize(const struct term_t * t) {
+    unsigned int base = workp, n = 0;
+    wpush(NULL, NULL, t, 0);
+    while (workp > base && n < CUTOFF) {
+        t = work[--workp].src;
+        n++;
+        switch (t->type) {
+            case tlambda:
+                wpush(NULL, NULL, t->data.lambda_t.body, 0);
+                break;
+            case tapp:
+                wpush(NULL, NULL, t->data.app_t.right, 0);
+                wpush(NULL, NULL, t->data.app_t.left, 0);
+                break;
+        }
+    }
+    workp = base;
+    return n;
+}
+
+static bool pspawn(struct term_t * app) {
+    struct task * task;
+    if (!pool->idle || own->top == DEQUE_SIZE)
+        return false;
+    if (tsize(app->data.app_t.left) < CUTOFF || tsize(app->data.app_t.right) < CUTOFF)
+        return false;
+    pthread_mutex_lock(&own->lock);
+    task = &own->tasks[own->top++];
+    task->slot = &app->data.app_t.right;
+    task->done = false;
+    pthread_mutex_unlock(&own->lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->posted++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/* Takes back the task spawned last. Returns false if it was not stolen, or true
+ * once the thief is done with it; the waiting thread helps out meanwhile. */
+static bool pjoin(void) {
+    struct task * task;
+    bool done;
+    pthread_mutex_lock(&own->lock);
+    if (own->bottom < own->top) {
+        own->top--;
+        pthread_mutex_unlock(&own->lock);
+        return false;
+    }
+    task = &own->tasks[own->top - 1];
+    pthread_mutex_unlock(&own->lock);
+    __sync_fetch_and_add(&pool->idle, 1);
+    for (;;) {
+        pthread_mutex_lock(&own->lock);
+        done = task->done;
+        pthread_mutex_unlock(&own->lock);
+        if (done)
+            break;
+        if (!psteal())
+            sched_yield();
+    }
+    __sync_fetch_and_sub(&pool->idle, 1);
+    pthread_mutex_lock(&own->lock);
+    own->bottom = --own->top;
+    pthread_mutex_unlock(&own->lock);
+    return true;
+}
+
+static bool psteal(void) {
+    unsigned int i;
+    for (i = 1; i < pool->size; i++) {
+        struct deque * d = &pool->deques[(own - pool->deques + i) % pool->size];
+        struct task * task = NULL;
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom < d->top)
+            task = &d->tasks[d->bottom++];
+        pthread_mutex_unlock(&d->lock);
+        if (task) {
+            __sync_fetch_and_sub(&pool->idle, 1);
+            deep(task->slot, pool->beta);
+            if (tresult != rnormal)
+                pool->halt = tresult;
+            __sync_fetch_and_add(&pool->idle, 1);
+            pthread_mutex_lock(&d->lock);
+            task->done = true;
+            pthread_mutex_unlock(&d->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void * pworker(void * arg) {
+    unsigned int round = 0, posted;
+    own = arg;
+    pool = own->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->round == round && !pool->quit)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        round = pool->round;
+        posted = pool->posted;
+        pthread_mutex_unlock(&pool->lock);
+        heap.alloc = pool->heap.alloc;
+        heap.release = pool->heap.release;
+        budget.fueled = pool->budget.fueled;
+        budget.timed = pool->budget.timed;
+        budget.deadline = pool->budget.deadline;
+        tresult = rnormal;
+        memset(&tstats, 0, sizeof(tstats));
+        for (;;) {
+            while (psteal())
+                ;
+            pthread_mutex_lock(&pool->lock);
+            if (pool->stop)
+                break;
+            if (pool->posted == posted)
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            posted = pool->posted;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        own->stats = tstats;
+        own->heap = tdetach();
+        uflush();
+        pthread_mutex_lock(&pool->lock);
+        pool->parked++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Runs a round of the pool of tparallel() on *ppterm. Returns false without doing
+ * anything if another thread is running one. */
+static bool pdeep(struct term_t ** ppterm, beta_t beta) {
+    struct pool * p = team;
+    unsigned int i;
+    if (pthread_mutex_trylock(&p->busy))
+        return false;
+    p->beta = beta;
+    p->heap = heap;
+    p->idle = p->size - 1;
+    p->stop = false;
+    p->halt = rnormal;
+    p->budget = budget;
+    p->fuel = budget.fuel;
+    for (i = 0; i < p->size; i++) {
+        p->deques[i].bottom = p->deques[i].top = 0;
+        p->deques[i].heap = NULL;
+    }
+    pool = p;
+    own = &p->deques[0];
+    pthread_mutex_lock(&p->lock);
+    p->round++;
+    p->parked = 0;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    deep(ppterm, beta);
+    if (tresult != rnormal)
+        p->halt = tresult;
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    while (p->parked < p->size - 1)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    budget.fuel = p->fuel;
+    for (i = 1; i < p->size; i++) {
+        tadopt(p->deques[i].heap);
+        tmerge(&p->deques[i].stats);
+    }
+    pool = NULL;
+    own = NULL;
+    pthread_mutex_unlock(&p->busy);
+    return true;
+}
+
+/* Lets the workers of the pool go and frees it. */
+static void pstop(void) {
+    struct pool * p = team;
+    unsigned int i;
+    team = NULL;
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 1; i < p->size; i++)
+        pthread_join(p->ids[i], NULL);
+    for (i = 0; i < p->size; i++)
+        pthread_mutex_destroy(&p->deques[i].lock);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->busy);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->deques);
+    free(p->ids);
+    free(p);
+}
+
+/* Limits the evaluations of the calling thread to fuel beta steps and ms
+ * milliseconds from now, either of them unlimited if 0. Stopped evaluations leave
+ * a partially reduced term behind that can be evaluated further later on. */
+void tlimit(unsigned long fuel, unsigned long ms) {
+    budget.fueled = fuel != 0;
+    budget.fuel = fuel;
+    budget.timed = ms != 0;
+    budget.ticks = 0;
+    if (ms) {
+        clock_gettime(CLOCK_MONOTONIC, &budget.deadline);
+        budget.deadline.tv_sec += ms / 1000 + (budget.deadline.tv_nsec + ms % 1000 * 1000000) / 1000000000;
+        budget.deadline.tv_nsec = (budget.deadline.tv_nsec + ms % 1000 * 1000000) % 1000000000;
+    }
+    tresult = rnormal;
+}
+
+/* Reads what is left of the budget in the terms of tlimit(), for another thread
+ * to take over. Returns false, with tresult telling why, if nothing is. */
+bool tleft(unsigned long * fuel, unsigned long * ms) {
+    struct timespec now;
+    tresult = rnormal;
+    *fuel = *ms = 0;
+    if (budget.fueled && !(*fuel = budget.fuel)) {
+        tresult = rfuel;
+        return false;
+    }
+    if (budget.timed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > budget.deadline.tv_sec
+         || (now.tv_sec == budget.deadline.tv_sec && now.tv_nsec >= budget.deadline.tv_nsec)) {
+            tresult = rtime;
+            return false;
+        }
+        *ms = (budget.deadline.tv_sec - now.tv_sec) * 1000 + (budget.deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+    }
+    return true;
+}
+
+/* Takes a beta step off the budget. Returns false, with tresult telling why,
+ * once the evaluation has to stop. Parallel workers also stop once another
+ * thread of their pool has, and running out of fuel stops all of them. */
+bool tspend(void) {
+    if (budget.fueled && pool) {
+        unsigned long fuel;
+        do
+            if (!(fuel = pool->fuel)) {
+                tresult = pool->halt = rfuel;
+                return false;
+            }
+        while (!__sync_bool_compare_and_swap(&pool->fuel, fuel, fuel - 1));
+    } else if (budget.fueled) {
+        if (!budget.fuel) {
+            tresult = rfuel;
+            return false;
+        }
+        budget.fuel--;
+    }
+    if (budget.timed && ++budget.ticks == TICKS) {
+        struct timespec now;
+        budget.ticks = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > budget.deadline.tv_sec
+         || (now.tv_sec == budget.deadline.tv_sec && now.tv_nsec >= budget.deadline.tv_nsec)) {
+            tresult = rtime;
+            return false;
+        }
+    }
+    if (pool && pool->halt) {
+        tresult = pool->halt;
+        return false;
+    }
+    return true;
+}
+
+/* Adds up the counters of a worker; its peak adds to ours as they ran at once. */
+static void tmerge(const struct stats * s) {
+    tstats.betas += s->betas;
+    tstats.substs += s->substs;
+    tstats.copies += s->copies;
+    tstats.renames += s->renames;
+    tstats.walks += s->walks;
+    tstats.allocs += s->allocs;
+    tstats.frees += s->frees;
+    tstats.peak += s->peak;
+    tstats.hits += s->hits;
+    tstats.misses += s->misses;
+    tstats.etas += s->etas;
+    tstats.inlines += s->inlines;
+    tstats.drops += s->drops;
+    if (s->spine > tstats.spine)
+        tstats.spine = s->spine;
+}
+
+/* Starts a pool of n - 1 workers for strong normalization, which the thread
+ * normalizing a term joins; workers that could not be started are left out. The
+ * previous pool, if any, is let go first, and no pool is kept for n < 2. */
+void tparallel(unsigned int n) {
+    struct pool * p;
+    unsigned int i;
+    if (team)
+        pstop();
+    if (n < 2)
+        return;
+    if (!(p = calloc(1, sizeof(*p))) || !(p->deques = malloc(n * sizeof(*p->deques)))
+     || !(p->ids = malloc(n * sizeof(*p->ids))))
+        tnomem();
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->busy, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        p->deques[i].pool = p;
+    }
+    for (p->size = 1; p->size < n; p->size++)
+        if (pthread_create(&p->ids[p->size], NULL, pworker, &p->deques[p->size]))
+            break;
+    for (i = p->size; i < n; i++)
+        pthread_mutex_destroy(&p->deques[i].lock);
+    team = p;
+    if (p->size < 2)
+        pstop();
+}
+
+void evalbname(struct term_t ** ppterm) {
+    tresult = rnormal;
+    bname(ppterm, nbeta, false);
+}
+
+void evalbvalue(struct term_t ** ppterm) {
+    tresult = rnormal;
+    bvalue(ppterm, nbeta);
+}
+
+void evaldeep(struct term_t ** ppterm) {
+    tresult = rnormal;
+    deep(ppterm, nbeta);
+}
+
+void dbevalbname(struct term_t ** ppterm) {
+    tresult = rnormal;
+    tdbruijn(*ppterm);
+    bname(ppterm, dbeta, false);
+    tnamed(*ppterm);
+}
+
+void dbevalbvalue(struct term_t ** ppterm) {
+    tresult = rnormal;
+    tdbruijn(*ppterm);
+    bvalue(ppterm, dbeta);
+    tnamed(*ppterm);
+}
+
+void dbevaldeep(struct term_t ** ppterm) {
+    tresult = rnormal;
+    tdbruijn(*ppterm);
+    deep(ppterm, dbeta);
+    tnamed(*ppterm);
+}
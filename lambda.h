@@ -21,18 +21,40 @@
 #define _LAMBDA_CALCULUS_H
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <setjmp.h>
 
-#define STACK_SIZE 1024
-#define STRING_MAX 2048
+/* Storage class of the state each thread keeps to itself: the node heaps and the
+ * work stacks of the evaluators. */
+#define TLS __thread
+
+/* Keeps the callers of functions that never return lean. */
+#define NORETURN __attribute__((noreturn))
+
+#define EMPTY_BITMAP {{ 0, 0, 0, 0}}
+
+struct bitmap {
+    unsigned int t[4];
+};
 
 enum {
     tlambda,
     tapp,
-    tvariabl
+    tvariabl,
+    tindex,
+    tnumber,
+    tprim
 };
 
+/* free_vars caches the free variables of a named term. It is exact when the node
+ * is built and stays a superset of the real set while reduction rewrites the
+ * subterms in place, since beta steps never introduce new free variables. Native
+ * integers and the primitives on them are closed leaves, see native.c. The origin
+ * of a lambda tells which lambda of the input it is a copy of, see profile.c. */
 struct term_t {
     int type;
+    struct bitmap free_vars;
+    unsigned int origin;
     union {
         struct {
             char var;
@@ -43,19 +65,240 @@ struct term_t {
             struct term_t * right;
         } app_t;
         char var;
+        unsigned int index;
+        unsigned long number;
+        unsigned int prim;
     } data;
 };
 
+/* Input being parsed: the bytes in [p, end) have not been read yet. A file is
+ * mapped as a whole, other input is read into buf as the parser asks for more.
+ * The parser counts the lines and columns it has read, from zero; input held in
+ * memory has no name. */
+struct source {
+    const char * name;
+    unsigned long line, column;
+    const char * p, * end;
+    int fd;
+    char * buf;
+    void * map;
+    size_t length;
+};
+
+struct source * sopen(const char *);
+bool sfill(struct source *);
+void sclose(struct source *);
+
+extern TLS const char * terror;
+
+/* Work done by the calling thread since the last treset(): beta steps, calls to
+ * substitute(), nodes copied, alpha renamings, free variable walks, nodes handed
+ * out and taken back by palloc() and pfree(), the most nodes live at once, the
+ * deepest spine, the normal form cache lookups that hit and missed, and the eta,
+ * linear and dead redexes toptimize() took out. Compiling with -DNSTATS leaves
+ * them all at zero. */
+struct stats {
+    unsigned long betas, substs, copies, renames, walks, allocs, frees, peak, spine, hits, misses, etas, inlines, drops;
+};
+
+#ifdef NSTATS
+#define STAT(counter)
+#define STATMAX(counter, n)
+#else
+#define STAT(counter) (tstats.counter++)
+#define STATMAX(counter, n) (tstats.counter < (n) ? tstats.counter = (n) : 0)
+#endif
+
+extern TLS struct stats tstats;
+
+/* A De Bruijn term packed into a preorder array of words: two tag bits under the
+ * name of a binder or free variable, or under an index. Every node is followed by
+ * its operands, so no further structure is needed. Variable words with a payload
+ * past the names are native: WNUMBER is followed by the low and the high 32 bits
+ * of an integer, and WPRIM(p) is primitive p. */
+enum {
+    wlam,
+    wapp,
+    widx,
+    wvar
+};
+
+#define WNUMBER (256U << 2 | wvar)
+#define WPRIM(p) ((257U + (p)) << 2 | wvar)
+
+bool tsparse(struct source *, struct term_t **);
+bool tbparse(struct source *, struct term_t **);
 struct term_t * tparse(char *);
 struct term_t * tcparse(const struct term_t *);
 void tfparse(struct term_t *);
 void tdparse(const struct term_t *, FILE *);
+void tswrite(const struct term_t *, FILE *);
+void tbwrite(struct term_t *, FILE *);
+unsigned int * tpack(const struct term_t *, size_t *);
+struct term_t * tunpack(const unsigned int *);
+
+/* The nodes of a thread: the slabs they are carved out of, the ones given back,
+ * and where the memory for slabs comes from, malloc() and free() if NULL. A zeroed
+ * heap is an empty one. */
+struct heap {
+    struct slab * slabs;
+    struct term_t * free_list;
+    unsigned int slab_used;
+    void * (*alloc)(size_t);
+    void (*release)(void *);
+};
+
+struct term_t * palloc(void);
+void pfree(struct term_t *);
+void treset(void);
+void tclear(void);
+void tswap(struct heap *);
+
+/* Reasons for a thread to give up, see tfail(). */
+enum {
+    fnomem = 1,
+    fvars,
+    fthreads,
+    fcompile,
+    fsize
+};
+
+/* Giving up longjmp()s to tbail if the calling thread has set it, leaving the
+ * reason in tfailure, and prints the reason and aborts otherwise. */
+extern TLS jmp_buf * tbail;
+extern TLS int tfailure;
+extern const char * const tfailures[];
+NORETURN void tfail(int);
+NORETURN void tnomem(void);
+void tunwind(void);
 
-void substart(void);
 void substitute(struct term_t *, char, const struct term_t *);
 
+/* Rewrites away eta redexes and the beta redexes whose variable is used at most
+ * once, call-by-value if strict, before a term is evaluated. */
+void toptimize(struct term_t **, bool);
+
 void evalbname(struct term_t **);
 void evalbvalue(struct term_t **);
 void evaldeep(struct term_t **);
 
+/* Normalizes a term in normal order while writing it like tswrite(), or tdparse()
+ * if not plain: each head goes out as soon as it is found and every node is freed
+ * once written, so the term is used up. */
+void tstream(struct term_t *, bool, FILE *);
+
+void tparallel(unsigned int);
+
+/* Why the last evaluation stopped: it reached the form it was after, ran out of
+ * the steps or the time given to tlimit(), or met native arithmetic whose result
+ * doesn't fit, see native.c. */
+enum {
+    rnormal,
+    rfuel,
+    rtime,
+    roverflow
+};
+
+extern TLS int tresult;
+
+void tlimit(unsigned long, unsigned long);
+bool tleft(unsigned long *, unsigned long *);
+bool tspend(void);
+
+void tdbruijn(struct term_t *);
+void tnamed(struct term_t *);
+
+void dbevalbname(struct term_t **);
+void dbevalbvalue(struct term_t **);
+void dbevaldeep(struct term_t **);
+
+void shevalbname(struct term_t **);
+void shevalbvalue(struct term_t **);
+void shevaldeep(struct term_t **);
+void shclear(void);
+
+void evalbneed(struct term_t **);
+
+void kevalbname(struct term_t **);
+void kevalbvalue(struct term_t **);
+void kevaldeep(struct term_t **);
+void kclear(void);
+
+void cevaldeep(struct term_t **);
+
+void ievaldeep(struct term_t **);
+
+void aevaldeep(struct term_t **);
+
+/* Work charged to the lambdas of the input, see profile.c. */
+struct ucount {
+    unsigned long betas, copies, renames;
+};
+
+extern bool uprofiling;
+extern TLS struct ucount * ucharged;
+
+unsigned int usite(const char *, unsigned long, unsigned long);
+void ustamp(struct term_t *, const char *, size_t);
+void ucharge(unsigned int);
+void uflush(void);
+bool ureport(const char *, bool);
+
+struct term_t * tlookup(const char *, size_t);
+bool tdefine(const char *, size_t, struct term_t *);
+bool tprelude(const char *);
+bool tsnapshot(const char *);
+unsigned long tdefinitions(unsigned long, void (*)(unsigned int *, unsigned int, void *), void *);
+
+void mlimit(size_t);
+int mlookup(struct term_t **);
+void mrecord(const struct term_t *);
+unsigned int mpending(void);
+void mabandon(unsigned int);
+bool mload(const char *);
+bool msave(const char *);
+
+struct term_t * tliteral(const char *, size_t);
+void tlname(const struct term_t *, char *);
+struct term_t * tnumeral(unsigned long, bool);
+bool tsaturated(const struct term_t *);
+int tprimitive(struct term_t **, bool);
+
+/* The largest integer whose numeral tchurch() builds for the evaluators that only
+ * see Church encodings, at two nodes per unit. */
+#define NUMERAL_MAX (1UL << 22)
+
+bool tchurch(struct term_t *, unsigned long);
+
+/* Embedding: a context owns the nodes of the terms it parses and evaluates,
+ * drawn from the allocator it was made with, along with its budget and the last
+ * error. Contexts share nothing but the definitions and the normal form cache, so
+ * threads may each use their own without locking; one context is only ever used
+ * by one thread at a time. Every call returns one of these codes. */
+enum {
+    lcok,
+    lcsyntax,
+    lcfuel,
+    lctime,
+    lcnomem,
+    lcoverflow,
+    lcvars,
+    lcthreads,
+    lccompile,
+    lcsize
+};
+
+struct context;
+
+struct context * lcnew(void * (*)(size_t), void (*)(void *));
+void lcfree(struct context *);
+void lclimit(struct context *, unsigned long, unsigned long);
+int lcparse(struct context *, const char *, size_t, struct term_t **);
+int lceval(struct context *, struct term_t **, void (*)(struct term_t **));
+int lcwrite(struct context *, const struct term_t *, bool, char **, size_t *);
+int lcrelease(struct context *, struct term_t *);
+const char * lcerror(const struct context *);
+
+void batch(struct source *, bool (*)(struct source *, struct term_t **), void (*)(struct term_t *, FILE *), unsigned int);
+
 #endif
@@ -0,0 +1,497 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lambda.h"
+
+#define CHUNK_SIZE 4096
+
+/* Abstract machines running the De Bruijn form of the input directly: the term is
+ * never rewritten, a beta step just conses a closure onto the environment. The
+ * Krivine machine does call-by-name (and normal order when reading back under
+ * binders), the CEK machine does call-by-value.
+ *
+ * An environment cell binds one index to a closure (term, env). Read-back binds
+ * the variables of lambdas it descends into to cells with a NULL term and the De
+ * Bruijn level of the binder. When it quotes what a stopped evaluation left, it
+ * counts the uses of every cell it reaches in that round (gen), links them up,
+ * and gives the ones used more than once the level of a binder too, see share(). */
+struct env {
+    unsigned int refs, level, gen, uses;
+    const struct term_t * term;
+    struct env * env;
+    struct env * next;
+    struct env * link;
+};
+
+/* Cells are carved out of chunks, which stay with the thread until kclear(). */
+struct chunk {
+    struct chunk * next;
+    struct env cells[CHUNK_SIZE];
+};
+
+/* A Krivine argument, a CEK argument waiting for its function, a CEK function
+ * still to be evaluated, or a closure still to be read back into *slot under
+ * depth binders. erelease() also parks the environments it is yet to release
+ * here, and share() the closures it is yet to scan with depth binders above them
+ * and the cells it is yet to be done with. */
+struct frame {
+    int kind;
+    const struct term_t * term;
+    struct env * env;
+    struct term_t ** slot;
+    unsigned int depth;
+};
+
+enum {
+    farg,
+    ffun,
+    fquote,
+    fnormal,
+    fshared,
+    fscan,
+    fdone
+};
+
+static struct env * ealloc(void);
+static struct env * eref(struct env *);
+static void erelease(struct env *);
+static struct env * econs(const struct term_t *, struct env *, struct env *);
+static struct env * elevel(unsigned int, struct env *);
+static struct env * enth(struct env *, unsigned int);
+static void push(int, const struct term_t *, struct env *);
+static void task(int, const struct term_t *, struct env *, struct term_t **, unsigned int);
+static void krivine(const struct term_t **, struct env **, unsigned int);
+static void cek(const struct term_t **, struct env **);
+static struct term_t * head(const struct term_t *, const struct env *, unsigned int);
+static struct term_t ** spine(struct term_t **, unsigned int, int, unsigned int);
+static struct term_t ** share(const struct term_t *, struct env *, struct term_t **, unsigned int *);
+static void readback(unsigned int);
+
+static TLS struct chunk * chunks = NULL;
+static TLS struct env * free_cells = NULL;
+static TLS struct frame * stack = NULL;
+static TLS unsigned int sp = 0, stack_size = 0;
+static TLS unsigned int gen = 0;
+
+static struct env * ealloc(void) {
+    struct env * e = free_cells;
+    if (!e) {
+        struct chunk * c = malloc(sizeof(*c));
+        int i;
+        if (!c)
+            tnomem();
+        c->next = chunks;
+        chunks = c;
+        e = c->cells;
+        for (i = 1; i < CHUNK_SIZE; i++)
+            e[i].next = i + 1 < CHUNK_SIZE ? &e[i + 1] : NULL;
+        free_cells = &e[1];
+        return e;
+    }
+    free_cells = e->next;
+    return e;
+}
+
+static struct env * eref(struct env * e) {
+    if (e)
+        e->refs++;
+    return e;
+}
+
+static void erelease(struct env * e) {
+    unsigned int base = sp;
+    for (;;) {
+        while (e && --e->refs == 0) {
+            struct env * next = e->next;
+            if (e->env)
+                push(farg, NULL, e->env);
+            e->next = free_cells;
+            free_cells = e;
+            e = next;
+        }
+        if (sp == base)
+            return;
+        e = stack[--sp].env;
+    }
+}
+
+/* Takes over the references to env and next. */
+static struct env * econs(const struct term_t * term, struct env * env, struct env * next) {
+    struct env * e = ealloc();
+    e->refs = 1;
+    e->gen = 0;
+    e->term = term;
+    e->env = env;
+    e->next = next;
+    return e;
+}
+
+static struct env * elevel(unsigned int level, struct env * next) {
+    struct env * e = econs(NULL, NULL, next);
+    e->level = level;
+    return e;
+}
+
+static struct env * enth(struct env * e, unsigned int n) {
+    while (n--)
+        e = e->next;
+    return e;
+}
+
+static void push(int kind, const struct term_t * term, struct env * env) {
+    if (sp == stack_size) {
+        stack_size = stack_size ? stack_size * 2 : 1024;
+        if (!(stack = realloc(stack, stack_size * sizeof(*stack))))
+            tnomem();
+    }
+    stack[sp].kind = kind;
+    stack[sp].term = term;
+    stack[sp++].env = env;
+}
+
+static void task(int kind, const struct term_t * term, struct env * env, struct term_t ** slot, unsigned int depth) {
+    push(kind, term, env);
+    stack[sp - 1].slot = slot;
+    stack[sp - 1].depth = depth;
+}
+
+/* Runs until the term is a lambda with no arguments above base, or its head is a
+ * variable. A head bound by read-back is returned as a NULL term and its cell.
+ * Once the budget is spent, a lambda is returned with its arguments still above
+ * base. */
+static void krivine(const struct term_t ** pterm, struct env ** penv, unsigned int base) {
+    const struct term_t * t = *pterm;
+    struct env * e = *penv, * c;
+    for (;;)
+        switch (t->type) {
+            case tapp: {
+                    push(farg, t->data.app_t.right, eref(e));
+                    STATMAX(spine, sp - base);
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            case tlambda: {
+                    if (sp == base || !tspend())
+                        goto Done;
+                    sp--;
+                    STAT(betas);
+                    e = econs(stack[sp].term, stack[sp].env, e);
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tindex: {
+                    c = enth(e, t->data.index);
+                    if (!c->term) {
+                        eref(c);
+                        erelease(e);
+                        e = c;
+                        t = NULL;
+                        goto Done;
+                    }
+                    t = c->term;
+                    eref(c->env);
+                    erelease(e);
+                    e = c->env;
+                    continue;
+                }
+            case tvariabl:
+                goto Done;
+            default:
+                abort();
+        }
+Done:
+    *pterm = t;
+    *penv = e;
+}
+
+/* Runs until the term is a value with nothing to feed it to, or the budget is
+ * spent. Like evalbvalue(), the right operand of an application is evaluated
+ * before the left one, and the machine stops as soon as a value other than a
+ * lambda is applied to an argument. It stops with the continuation still on the
+ * stack, and returns the value that was to be fed to it. */
+static void cek(const struct term_t ** pterm, struct env ** penv) {
+    const struct term_t * t = *pterm;
+    struct env * e = *penv, * c;
+    unsigned int base = sp;
+    for (;;) {
+        struct frame f;
+        switch (t->type) {
+            case tapp: {
+                    push(ffun, t->data.app_t.left, eref(e));
+                    t = t->data.app_t.right;
+                    continue;
+                }
+            case tlambda:
+                break;
+            case tindex: {
+                    c = enth(e, t->data.index);
+                    t = c->term;
+                    eref(c->env);
+                    erelease(e);
+                    e = c->env;
+                    break;
+                }
+            case tvariabl: {
+                    erelease(e);
+                    e = NULL;
+                    break;
+                }
+            default:
+                abort();
+        }
+        /* (t, e) is a value: feed it to the innermost continuation. */
+        if (sp == base)
+            break;
+        f = stack[--sp];
+        if (f.kind == ffun) {
+            push(farg, t, e);
+            t = f.term;
+            e = f.env;
+            continue;
+        }
+        if (t->type != tlambda || !tspend()) {
+            sp++;
+            break;
+        }
+        STAT(betas);
+        e = econs(f.term, f.env, e);
+        t = t->data.lambda_t.body;
+    }
+    *pterm = t;
+    *penv = e;
+}
+
+static struct term_t * head(const struct term_t * t, const struct env * e, unsigned int depth) {
+    struct term_t * p = palloc();
+    if (t) {
+        p->type = tvariabl;
+        p->data.var = t->data.var;
+    } else {
+        p->type = tindex;
+        p->data.index = depth - 1 - e->level;
+    }
+    return p;
+}
+
+/* Stores the frames krivine() or cek() left above base in *slot: an argument
+ * applies what is above it to itself, a function itself to what is above it. The
+ * frames turn into tasks of the given kind to read their closures back, and the
+ * slot left for what is above all of them is returned. */
+static struct term_t ** spine(struct term_t ** slot, unsigned int base, int kind, unsigned int depth) {
+    unsigned int i;
+    for (i = base; i < sp; i++) {
+        struct term_t * app = palloc();
+        app->type = tapp;
+        *slot = app;
+        if (stack[i].kind == ffun) {
+            stack[i].slot = &app->data.app_t.left;
+            slot = &app->data.app_t.right;
+        } else {
+            stack[i].slot = &app->data.app_t.right;
+            slot = &app->data.app_t.left;
+        }
+        stack[i].kind = kind;
+        stack[i].depth = depth;
+    }
+    return slot;
+}
+
+/* Quotes a closure left by a stopped evaluation without copying what its cells
+ * share: substituting them all could take time and space exponential in the
+ * steps taken. Scans the terms of the cells the closure reaches, each once, and
+ * binds every cell used more than once to a lambda applied to its closure, in
+ * the order the scan is done with them, so that a cell is bound inside the cells
+ * it uses. The slot left for the closure itself is returned, with depth moved
+ * past the binders; the bound closures become fshared tasks. */
+static struct term_t ** share(const struct term_t * t, struct env * e, struct term_t ** slot, unsigned int * depth) {
+    unsigned int base = sp;
+    struct env * first, ** last = &first, * c;
+    gen++;
+    task(fscan, t, e, NULL, 0);
+    while (sp > base) {
+        struct frame f = stack[--sp];
+        if (f.kind == fdone) {
+            *last = f.env;
+            last = &f.env->link;
+            continue;
+        }
+        for (t = f.term; t->type == tlambda || t->type == tapp; )
+            if (t->type == tlambda) {
+                t = t->data.lambda_t.body;
+                f.depth++;
+            } else {
+                task(fscan, t->data.app_t.right, f.env, NULL, f.depth);
+                t = t->data.app_t.left;
+            }
+        if (t->type != tindex || t->data.index < f.depth || !(c = enth(f.env, t->data.index - f.depth))->term)
+            continue;
+        if (c->gen != gen) {
+            c->gen = gen;
+            c->uses = 0;
+        }
+        if (!c->uses++) {
+            task(fdone, NULL, c, NULL, 0);
+            task(fscan, c->term, c->env, NULL, 0);
+        }
+    }
+    *last = NULL;
+    for (c = first; c; c = c->link)
+        if (c->uses > 1) {
+            struct term_t * app = palloc(), * lambda = palloc();
+            app->type = tapp;
+            app->data.app_t.left = lambda;
+            lambda->type = tlambda;
+            lambda->data.lambda_t.var = 'v';
+            *slot = app;
+            task(fshared, c->term, eref(c->env), &app->data.app_t.right, *depth);
+            c->level = (*depth)++;
+            slot = &lambda->data.lambda_t.body;
+        }
+    return slot;
+}
+
+/* Reads the closures of the tasks above base back into terms. A fquote task does
+ * not reduce its closure any further, a fnormal one reads back its normal form,
+ * reducing under binders in normal order, or quotes it once the budget is spent.
+ * Quoting after the budget is spent goes through share(), and an fshared task
+ * reads the cells bound there back as their binders. Every task owns its
+ * environment. */
+static void readback(unsigned int base) {
+    while (sp > base) {
+        struct frame f = stack[--sp];
+        const struct term_t * t = f.term;
+        struct env * e = f.env, * c;
+        struct term_t * p;
+        for (;;) {
+            if (f.kind == fnormal && tresult != rnormal)
+                f.kind = fquote;
+            if (f.kind == fquote && tresult != rnormal) {
+                f.slot = share(t, e, f.slot, &f.depth);
+                f.kind = fshared;
+            }
+            if (f.kind == fnormal) {
+                unsigned int args = sp;
+                krivine(&t, &e, args);
+                if (!t || t->type != tlambda || sp > args) {
+                    f.slot = spine(f.slot, args, fnormal, f.depth);
+                    if (t && t->type == tlambda) {
+                        f.kind = fquote;
+                        continue;
+                    }
+                    *f.slot = head(t, e, f.depth);
+                    erelease(e);
+                    break;
+                }
+            }
+            if (t->type == tlambda) {
+                p = *f.slot = palloc();
+                p->type = tlambda;
+                p->data.lambda_t.var = t->data.lambda_t.var;
+                e = elevel(f.depth++, e);
+                t = t->data.lambda_t.body;
+                f.slot = &p->data.lambda_t.body;
+            } else if (t->type == tapp) {
+                p = *f.slot = palloc();
+                p->type = tapp;
+                task(f.kind, t->data.app_t.right, eref(e), &p->data.app_t.right, f.depth);
+                t = t->data.app_t.left;
+                f.slot = &p->data.app_t.left;
+            } else if (t->type == tvariabl) {
+                *f.slot = head(t, e, f.depth);
+                erelease(e);
+                break;
+            } else if ((c = enth(e, t->data.index))->term && (f.kind != fshared || c->uses < 2)) {
+                t = c->term;
+                eref(c->env);
+                erelease(e);
+                e = c->env;
+            } else {
+                *f.slot = head(NULL, c, f.depth);
+                erelease(e);
+                break;
+            }
+        }
+    }
+}
+
+void kevalbname(struct term_t ** ppterm) {
+    const struct term_t * t = *ppterm;
+    struct env * e = NULL;
+    struct term_t * r, ** slot;
+    unsigned int base = sp;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    krivine(&t, &e, base);
+    slot = spine(&r, base, fquote, 0);
+    if (t && t->type == tlambda)
+        task(fquote, t, e, slot, 0);
+    else {
+        *slot = head(t, e, 0);
+        erelease(e);
+    }
+    readback(base);
+    tfparse(*ppterm);
+    tnamed(*ppterm = r);
+}
+
+void kevalbvalue(struct term_t ** ppterm) {
+    const struct term_t * t = *ppterm;
+    struct env * e = NULL;
+    struct term_t * r, ** slot;
+    unsigned int base = sp;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    cek(&t, &e);
+    slot = spine(&r, base, fquote, 0);
+    task(fquote, t, e, slot, 0);
+    readback(base);
+    tfparse(*ppterm);
+    tnamed(*ppterm = r);
+}
+
+void kevaldeep(struct term_t ** ppterm) {
+    struct term_t * r;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    task(fnormal, *ppterm, NULL, &r, 0);
+    readback(sp - 1);
+    tfparse(*ppterm);
+    tnamed(*ppterm = r);
+}
+
+/* Gives back the cells and the stack of the calling thread, along with whatever
+ * an evaluation that was cut short left in them. */
+void kclear(void) {
+    struct chunk * c;
+    while ((c = chunks)) {
+        chunks = c->next;
+        free(c);
+    }
+    free_cells = NULL;
+    free(stack);
+    stack = NULL;
+    sp = stack_size = 0;
+}
@@ -0,0 +1,421 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "lambda.h"
+
+/* A cache of normal forms shared by all threads. Keys are closed terms packed
+ * with tpack() with the names of their binders masked out, so alpha-equivalent
+ * terms meet in the same entry. The least recently used entries go first once
+ * the cache takes more than its cap. Terms smaller than MEMO_MIN nodes are
+ * cheaper to reduce than to look up. */
+#define MEMO_MIN 16
+#define BUCKETS_MIN 1024
+#define FILE_VERSION 2
+
+struct entry {
+    unsigned long hash;
+    unsigned int * key, * value;
+    size_t ksize, vsize;
+    struct entry * next, * older, * newer;
+};
+
+/* A cache file is a header and count entries, each the sizes of its key and its
+ * value followed by their words. The checksum covers everything past the
+ * header. */
+struct header {
+    char magic[4];
+    unsigned int version, count, checksum;
+};
+
+/* Keys of the terms being normalized whose normal forms go in the cache once
+ * they are done, innermost last. */
+struct pending {
+    unsigned int * key;
+    size_t size;
+    unsigned long hash;
+};
+
+static unsigned int * mpack(const struct term_t *, size_t *);
+static unsigned int msum(unsigned int, const unsigned int *, size_t);
+static unsigned long mhash(const unsigned int *, size_t);
+static bool mequal(const unsigned int *, const unsigned int *, size_t);
+static struct entry ** mfind(const unsigned int *, size_t, unsigned long);
+static void mtouch(struct entry *);
+static void munlink(struct entry *);
+static void minsert(unsigned int *, size_t, unsigned long, unsigned int *, size_t);
+
+static const char magic[4] = { 'L', 'C', 'M', 'C' };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cap = 0, used = 0;
+static struct entry ** buckets = NULL;
+static unsigned long nbuckets = 0, count = 0;
+static struct entry * oldest = NULL, * newest = NULL;
+static TLS struct pending * pending = NULL;
+static TLS unsigned int pendingp = 0, pending_size = 0;
+
+/* Packs a copy of a named term in De Bruijn form. */
+static unsigned int * mpack(const struct term_t * t, size_t * size) {
+    struct term_t * copy = tcparse(t);
+    unsigned int * words;
+    tdbruijn(copy);
+    words = tpack(copy, size);
+    tfparse(copy);
+    return words;
+}
+
+static unsigned int msum(unsigned int sum, const unsigned int * words, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++)
+        sum = (sum ^ words[i]) * 16777619U;
+    return sum;
+}
+
+/* Binder names are left out of the hash and of comparisons, but not the raw
+ * words of an integer after WNUMBER. */
+#define MASK(w) (((w) & 3) == wlam ? wlam : (w))
+
+static unsigned long mhash(const unsigned int * words, size_t size) {
+    unsigned long h = 2166136261UL;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h = (h ^ MASK(words[i])) * 16777619UL;
+        if (words[i] == WNUMBER) {
+            h = (h ^ words[i + 1]) * 16777619UL;
+            h = (h ^ words[i + 2]) * 16777619UL;
+            i += 2;
+        }
+    }
+    return h;
+}
+
+static bool mequal(const unsigned int * a, const unsigned int * b, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (MASK(a[i]) != MASK(b[i]))
+            return false;
+        if (a[i] == WNUMBER) {
+            if (a[i + 1] != b[i + 1] || a[i + 2] != b[i + 2])
+                return false;
+            i += 2;
+        }
+    }
+    return true;
+}
+
+static struct entry ** mfind(const unsigned int * key, size_t size, unsigned long hash) {
+    struct entry ** e = &buckets[hash % nbuckets];
+    for (; *e; e = &(*e)->next) {
+        if ((*e)->hash == hash && (*e)->ksize == size && mequal((*e)->key, key, size))
+            break;
+    }
+    return e;
+}
+
+static void munlink(struct entry * e) {
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+}
+
+static void mtouch(struct entry * e) {
+    e->older = newest;
+    e->newer = NULL;
+    if (newest)
+        newest->newer = e;
+    else
+        oldest = e;
+    newest = e;
+}
+
+/* Takes over key and value. Called with the lock held, which it lets go of before
+ * giving up for lack of memory. */
+static void minsert(unsigned int * key, size_t ksize, unsigned long hash, unsigned int * value, size_t vsize) {
+    struct entry ** slot, * e;
+    size_t size = sizeof(*e) + (ksize + vsize) * sizeof(*key);
+    if (size > cap) {
+        free(key);
+        free(value);
+        return;
+    }
+    if (count >= nbuckets) {
+        unsigned long n = nbuckets ? nbuckets * 2 : BUCKETS_MIN, i;
+        struct entry ** b = calloc(n, sizeof(*b));
+        if (!b) {
+            pthread_mutex_unlock(&lock);
+            tnomem();
+        }
+        for (i = 0; i < nbuckets; i++)
+            while ((e = buckets[i])) {
+                buckets[i] = e->next;
+                e->next = b[e->hash % n];
+                b[e->hash % n] = e;
+            }
+        free(buckets);
+        buckets = b;
+        nbuckets = n;
+    }
+    if (*(slot = mfind(key, ksize, hash))) {
+        free(key);
+        free(value);
+        munlink(*slot);
+        mtouch(*slot);
+        return;
+    }
+    while (used + size > cap) {
+        struct entry ** p;
+        e = oldest;
+        munlink(e);
+        for (p = &buckets[e->hash % nbuckets]; *p != e; p = &(*p)->next)
+            ;
+        *p = e->next;
+        used -= sizeof(*e) + (e->ksize + e->vsize) * sizeof(*key);
+        count--;
+        free(e->key);
+        free(e->value);
+        free(e);
+    }
+    if (!(e = malloc(sizeof(*e)))) {
+        pthread_mutex_unlock(&lock);
+        tnomem();
+    }
+    e->hash = hash;
+    e->key = key;
+    e->ksize = ksize;
+    e->value = value;
+    e->vsize = vsize;
+    e->next = *mfind(key, ksize, hash);
+    *mfind(key, ksize, hash) = e;
+    mtouch(e);
+    used += size;
+    count++;
+}
+
+void mlimit(size_t bytes) {
+    cap = bytes;
+}
+
+/* Looks up the normal form of a closed named term, and puts it in place of the
+ * term. Returns 1 on a hit, 0 on a miss, when the caller owes mrecord() the normal
+ * form, and -1 when the term isn't worth caching or the cache is off. */
+int mlookup(struct term_t ** slot) {
+    struct term_t * t;
+    struct entry * e;
+    unsigned int * key;
+    unsigned long hash;
+    size_t size;
+    if (!cap)
+        return -1;
+    key = mpack(*slot, &size);
+    if (size < MEMO_MIN) {
+        free(key);
+        return -1;
+    }
+    hash = mhash(key, size);
+    pthread_mutex_lock(&lock);
+    if (nbuckets && (e = *mfind(key, size, hash))) {
+        /* Unpack a copy, as running out of nodes mustn't leave the lock held. */
+        unsigned int * value = malloc(e->vsize * sizeof(*value));
+        if (value)
+            memcpy(value, e->value, e->vsize * sizeof(*value));
+        munlink(e);
+        mtouch(e);
+        pthread_mutex_unlock(&lock);
+        free(key);
+        if (!value)
+            tnomem();
+        t = tunpack(value);
+        free(value);
+        tnamed(t);
+        tfparse(*slot);
+        *slot = t;
+        STAT(hits);
+        return 1;
+    }
+    pthread_mutex_unlock(&lock);
+    STAT(misses);
+    if (pendingp == pending_size) {
+        pending_size = pending_size ? pending_size * 2 : 64;
+        if (!(pending = realloc(pending, pending_size * sizeof(*pending))))
+            tnomem();
+    }
+    pending[pendingp].key = key;
+    pending[pendingp].size = size;
+    pending[pendingp++].hash = hash;
+    return 0;
+}
+
+/* Stores the normal form of the term of the innermost miss. */
+void mrecord(const struct term_t * t) {
+    struct pending * p = &pending[--pendingp];
+    unsigned int * value;
+    size_t size;
+    value = mpack(t, &size);
+    pthread_mutex_lock(&lock);
+    minsert(p->key, p->size, p->hash, value, size);
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned int mpending(void) {
+    return pendingp;
+}
+
+/* Forgets the misses after the first n, whose terms were not normalized. */
+void mabandon(unsigned int n) {
+    while (pendingp > n)
+        free(pending[--pendingp].key);
+}
+
+/* Reads a cache file, oldest entry first. A missing file is an empty cache; false
+ * means the file couldn't be read or isn't a sound cache, and nothing of it was
+ * loaded. */
+bool mload(const char * path) {
+    FILE * f = fopen(path, "rb");
+    struct header h;
+    unsigned int * words, n;
+    size_t size, i;
+    long length;
+    if (!f)
+        return errno == ENOENT;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, magic, sizeof(magic)) || h.version != FILE_VERSION
+            || fseek(f, 0, SEEK_END) || (length = ftell(f)) < 0 || fseek(f, sizeof(h), SEEK_SET)
+            || (length - sizeof(h)) % sizeof(*words)) {
+        fclose(f);
+        return false;
+    }
+    size = (length - sizeof(h)) / sizeof(*words);
+    if (!(words = malloc(size * sizeof(*words) + 1))) {
+        fclose(f);
+        tnomem();
+    }
+    if (fread(words, sizeof(*words), size, f) != size || msum(2166136261U, words, size) != h.checksum) {
+        free(words);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    /* Every entry must fit in what is left of the file, and the entries must
+     * cover all of it. */
+    for (i = 0, n = 0; n < h.count; n++) {
+        if (size - i < 2 || !words[i] || !words[i + 1]
+                || words[i] > size - i - 2 || words[i + 1] > size - i - 2 - words[i])
+            break;
+        i += 2 + words[i] + words[i + 1];
+    }
+    if (n < h.count || i != size) {
+        free(words);
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    for (i = 0, n = 0; n < h.count; n++) {
+        size_t ksize = words[i], vsize = words[i + 1];
+        unsigned int * key = malloc(ksize * sizeof(*key)), * value = malloc(vsize * sizeof(*value));
+        if (!key || !value) {
+            pthread_mutex_unlock(&lock);
+            tnomem();
+        }
+        memcpy(key, &words[i + 2], ksize * sizeof(*key));
+        memcpy(value, &words[i + 2 + ksize], vsize * sizeof(*value));
+        minsert(key, ksize, mhash(key, ksize), value, vsize);
+        i += 2 + ksize + vsize;
+    }
+    pthread_mutex_unlock(&lock);
+    free(words);
+    return true;
+}
+
+/* Writes the cache to a file next to path, then renames it over path, so that
+ * path holds either the old cache or the new one in whole. The file gets the mode
+ * of the one it replaces, or the one a new file would get, and not the private
+ * mode of mkstemp(). */
+bool msave(const char * path) {
+    size_t length = strlen(path);
+    char * temp = malloc(length + sizeof(".XXXXXX"));
+    unsigned int sizes[2];
+    struct header h;
+    struct entry * e;
+    struct stat st;
+    FILE * f = NULL;
+    mode_t mode;
+    bool ok;
+    int fd, saved;
+    if (!temp)
+        tnomem();
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".XXXXXX", sizeof(".XXXXXX"));
+    if (!stat(path, &st))
+        mode = st.st_mode & 07777;
+    else {
+        mode = umask(0);
+        umask(mode);
+        mode = 0666 & ~mode;
+    }
+    if ((fd = mkstemp(temp)) < 0 || fchmod(fd, mode) || !(f = fdopen(fd, "wb"))) {
+        saved = errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        free(temp);
+        errno = saved;
+        return false;
+    }
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = FILE_VERSION;
+    h.count = 0;
+    h.checksum = 2166136261U;
+    fwrite(&h, sizeof(h), 1, f);
+    pthread_mutex_lock(&lock);
+    for (e = oldest; e; e = e->newer) {
+        sizes[0] = e->ksize;
+        sizes[1] = e->vsize;
+        fwrite(sizes, sizeof(sizes), 1, f);
+        fwrite(e->key, sizeof(*e->key), e->ksize, f);
+        fwrite(e->value, sizeof(*e->value), e->vsize, f);
+        h.checksum = msum(h.checksum, sizes, 2);
+        h.checksum = msum(h.checksum, e->key, e->ksize);
+        h.checksum = msum(h.checksum, e->value, e->vsize);
+        h.count++;
+    }
+    pthread_mutex_unlock(&lock);
+    ok = !ferror(f);
+    rewind(f);
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 && ok;
+    ok = !fclose(f) && ok;
+    ok = ok && !rename(temp, path);
+    if (!ok) {
+        saved = errno;
+        unlink(temp);
+        errno = saved;
+    }
+    free(temp);
+    return ok;
+}
@@ -0,0 +1,316 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lambda.h"
+
+#define MAX_ARITY 2
+#define CHUNK_SIZE 64
+
+/* Native integers written #n stand for Church numerals, and primitives written
+ * #name compute on them. The evaluators of lambda.c apply a primitive in a single
+ * step once its operands are normal and each is an integer or a Church numeral,
+ * and turn an integer applied to something into its numeral. The others only see
+ * the Church encodings tchurch() puts in place of both, so they give back numerals
+ * where these give back integers, and take integers up to NUMERAL_MAX. A sum,
+ * product or power too large for an unsigned long stops the evaluation with
+ * roverflow, leaving the application as it is, since its numeral could never be
+ * built either. Subtraction stops at zero like its Church counterpart. Comparisons
+ * yield Church booleans. */
+#define PRED "(\\k\\f\\x k (\\g\\h h (g f)) (\\u x) (\\u u))"
+#define ISZERO "(\\z\\a\\b b) (\\a\\b a)"
+
+/* In the order of the primitives below. */
+enum {
+    iadd,
+    isub,
+    imul,
+    ipow,
+    ieq,
+    ilt,
+    ile
+};
+
+static const struct primitive {
+    const char * name;
+    unsigned int arity;
+    const char * church;
+} primitives[] = {
+    { "add", 2, "\\m\\n\\f\\x m f (n f x)" },
+    { "sub", 2, "\\m\\n n " PRED " m" },
+    { "mul", 2, "\\m\\n\\f m (n f)" },
+    { "pow", 2, "\\m\\n n m" },
+    { "eq", 2, "\\m\\n (n " PRED " m " ISZERO ") (m " PRED " n " ISZERO ") (\\a\\b b)" },
+    { "lt", 2, "\\m\\n n " PRED " (\\f\\x f (m f x)) " ISZERO },
+    { "le", 2, "\\m\\n n " PRED " m " ISZERO }
+};
+
+#define PRIMITIVES (sizeof(primitives) / sizeof(*primitives))
+
+/* An occurrence of the variable name, or of the variable bound i binders up
+ * in a De Bruijn term. */
+#define BOUND(t, name, i) ((t)->type == tindex ? (t)->data.index == (i) \
+                          : (t)->type == tvariabl && (unsigned char) (t)->data.var == (name))
+
+static struct term_t * inode(int);
+static struct term_t * ichurch(const char *, bool);
+static bool inatural(const struct term_t *, unsigned long *);
+static bool ipower(unsigned long, unsigned long, unsigned long *);
+
+static const struct bitmap empty = EMPTY_BITMAP;
+
+static struct term_t * inode(int type) {
+    struct term_t * t = palloc();
+    t->type = type;
+    t->free_vars = empty;
+    return t;
+}
+
+/* Parses a closed term given in the source. */
+static struct term_t * ichurch(const char * s, bool indices) {
+    struct term_t * t = tparse((char *) s);
+    if (indices)
+        tdbruijn(t);
+    return t;
+}
+
+/* Reads an integer or a Church numeral, either named or De Bruijn. */
+static bool inatural(const struct term_t * t, unsigned long * n) {
+    unsigned int f, x;
+    if (t->type == tnumber) {
+        *n = t->data.number;
+        return true;
+    }
+    if (t->type != tlambda || t->data.lambda_t.body->type != tlambda)
+        return false;
+    f = (unsigned char) t->data.lambda_t.var;
+    x = (unsigned char) t->data.lambda_t.body->data.lambda_t.var;
+    /* The inner binder shadows an outer one of the same name. */
+    if (f == x)
+        f = 256;
+    for (*n = 0, t = t->data.lambda_t.body->data.lambda_t.body; t->type == tapp; t = t->data.app_t.right, ++*n)
+        if (!BOUND(t->data.app_t.left, f, 1))
+            return false;
+    return BOUND(t, x, 0);
+}
+
+/* Fails if m to the n doesn't fit. Squaring m past the last bit of n is not
+ * needed, but any other square that overflows ends up in the result. */
+static bool ipower(unsigned long m, unsigned long n, unsigned long * r) {
+    for (*r = 1; ; m *= m) {
+        if (n & 1) {
+            if (m && *r > -1UL / m)
+                return false;
+            *r *= m;
+        }
+        if (!(n >>= 1))
+            return true;
+        if (m && m > -1UL / m)
+            return false;
+    }
+}
+
+/* Makes the node written #name, or fails with terror set. */
+struct term_t * tliteral(const char * name, size_t length) {
+    struct term_t * t;
+    unsigned long n = 0;
+    size_t i;
+    if (length && name[0] >= '0' && name[0] <= '9') {
+        for (i = 0; i < length; i++) {
+            if (name[i] < '0' || name[i] > '9') {
+                terror = "Invalid number.";
+                return NULL;
+            }
+            if (n > (-1UL - (name[i] - '0')) / 10) {
+                terror = "Number too large.";
+                return NULL;
+            }
+            n = n * 10 + (name[i] - '0');
+        }
+        t = inode(tnumber);
+        t->data.number = n;
+        return t;
+    }
+    for (i = 0; i < PRIMITIVES; i++)
+        if (strlen(primitives[i].name) == length && !memcmp(primitives[i].name, name, length)) {
+            t = inode(tprim);
+            t->data.prim = i;
+            return t;
+        }
+    terror = "Unknown primitive.";
+    return NULL;
+}
+
+/* Writes a native node the way tliteral() reads it. */
+void tlname(const struct term_t * t, char * buf) {
+    if (t->type == tnumber)
+        sprintf(buf, "#%lu", t->data.number);
+    else
+        sprintf(buf, "#%s", primitives[t->data.prim].name);
+}
+
+/* Builds the Church numeral of n, in De Bruijn form if indices is set. */
+struct term_t * tnumeral(unsigned long n, bool indices) {
+    struct term_t * t = inode(tlambda), * p, * app;
+    t->data.lambda_t.var = 'f';
+    p = t->data.lambda_t.body = inode(tlambda);
+    p->data.lambda_t.var = 'x';
+    p = inode(tindex);
+    p->data.index = 0;
+    while (n--) {
+        app = inode(tapp);
+        app->data.app_t.left = inode(tindex);
+        app->data.app_t.left->data.index = 1;
+        app->data.app_t.right = p;
+        p = app;
+    }
+    t->data.lambda_t.body->data.lambda_t.body = p;
+    if (!indices)
+        tnamed(t);
+    return t;
+}
+
+/* Whether t applies a primitive to exactly as many operands as it takes. The
+ * evaluators ask at every application, so the walk gives up past MAX_ARITY. */
+bool tsaturated(const struct term_t * t) {
+    unsigned int n = 0;
+    for (; t->type == tapp; t = t->data.app_t.left)
+        if (++n > MAX_ARITY)
+            return false;
+    return t->type == tprim && primitives[t->data.prim].arity == n;
+}
+
+/* Applies the primitive of a saturated application whose operands are normal.
+ * Returns 1 once the result is in place, 0 if some operand isn't a number, and
+ * -1 if the budget ran out or the result would overflow, with tresult saying so. */
+int tprimitive(struct term_t ** slot, bool indices) {
+    struct term_t * t = *slot, * r;
+    unsigned long args[MAX_ARITY], number = 0;
+    unsigned int n, prim;
+    bool fits = true;
+    if (!tsaturated(t))
+        return 0;
+    for (n = 0, r = t; r->type == tapp; r = r->data.app_t.left)
+        n++;
+    prim = r->data.prim;
+    for (r = t; r->type == tapp; r = r->data.app_t.left)
+        if (!inatural(r->data.app_t.right, &args[--n]))
+            return 0;
+    switch (prim) {
+        case iadd:
+            fits = args[0] <= -1UL - args[1];
+            number = args[0] + args[1];
+            break;
+        case isub:
+            number = args[0] > args[1] ? args[0] - args[1] : 0;
+            break;
+        case imul:
+            fits = !args[0] || args[1] <= -1UL / args[0];
+            number = args[0] * args[1];
+            break;
+        case ipow:
+            fits = ipower(args[0], args[1], &number);
+            break;
+    }
+    if (!fits) {
+        tresult = roverflow;
+        return -1;
+    }
+    if (!tspend())
+        return -1;
+    STAT(betas);
+    switch (prim) {
+        case iadd:
+        case isub:
+        case imul:
+        case ipow: {
+                r = inode(tnumber);
+                r->data.number = number;
+                break;
+            }
+        case ieq:
+            r = ichurch(args[0] == args[1] ? "\\a\\b a" : "\\a\\b b", indices);
+            break;
+        case ilt:
+            r = ichurch(args[0] < args[1] ? "\\a\\b a" : "\\a\\b b", indices);
+            break;
+        case ile:
+            r = ichurch(args[0] <= args[1] ? "\\a\\b a" : "\\a\\b b", indices);
+            break;
+        default:
+            abort();
+    }
+    tfparse(t);
+    *slot = r;
+    return 1;
+}
+
+/* Puts the Church encodings in place of the native nodes of a named term. An
+ * integer past max leaves the term as it is and stops the evaluation with
+ * roverflow, the way arithmetic does, since its numeral could not be built. */
+bool tchurch(struct term_t * t, unsigned long max) {
+    struct term_t ** stack = NULL, * c;
+    unsigned int sp = 0, top = 0, size = 0;
+    /* The native nodes are leaves, so they pile up below the right operands. */
+    for (;;) {
+        if (sp == size) {
+            size = size ? size * 2 : CHUNK_SIZE;
+            if (!(stack = realloc(stack, size * sizeof(*stack))))
+                tnomem();
+        }
+        switch (t->type) {
+            case tlambda: {
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    stack[sp++] = t->data.app_t.right;
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            case tnumber:
+                if (t->data.number > max) {
+                    free(stack);
+                    tresult = roverflow;
+                    return false;
+                }
+                /* FALLTHROUGH */
+            case tprim: {
+                    if (sp > top)
+                        stack[sp] = stack[top];
+                    sp++;
+                    stack[top++] = t;
+                    break;
+                }
+        }
+        if (sp == top)
+            break;
+        t = stack[--sp];
+    }
+    while (top) {
+        t = stack[--top];
+        c = t->type == tnumber ? tnumeral(t->data.number, false)
+                               : ichurch(primitives[t->data.prim].church, false);
+        *t = *c;
+        pfree(c);
+    }
+    free(stack);
+    return true;
+}
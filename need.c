@@ -0,0 +1,325 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lambda.h"
+
+#define CHUNK_SIZE 4096
+
+/* Call-by-need works on a graph of De Bruijn nodes. A beta step instantiates the
+ * lambda body and points every occurrence of the bound variable at the argument
+ * node itself, so the argument is shared instead of copied. Once an application
+ * has been contracted it is overwritten with an indirection to the contractum,
+ * so every other reference to it sees the reduced form and nothing is reduced
+ * twice. Weak reduction never enters a lambda, so every node on the spine and
+ * every argument is closed and instantiation needs no shifting. */
+enum {
+    tindirect = tindex + 1
+};
+
+struct gterm_t {
+    int type;
+    unsigned int loose;
+    union {
+        struct {
+            char var;
+            struct gterm_t * body;
+        } lambda_t;
+        struct {
+            struct gterm_t * left;
+            struct gterm_t * right;
+        } app_t;
+        char var;
+        unsigned int index;
+        struct gterm_t * target;
+    } data;
+};
+
+/* Graph nodes are never freed one by one: the whole graph is dropped after it has
+ * been read back. */
+struct chunk {
+    struct chunk * next;
+    struct gterm_t nodes[CHUNK_SIZE];
+};
+
+/* Pending work of the traversals below, none of which recurse on the C stack: the
+ * node being converted or instantiated at depth binders, the copy waiting for its
+ * operands, and whether its left operand is done (n = 1). Reading back uses slot
+ * instead, and gwhnf() keeps the applications of its spine in t. */
+struct gframe {
+    struct gterm_t * t, * g;
+    const struct term_t * src;
+    struct term_t ** slot;
+    unsigned int depth, n;
+};
+
+static struct gterm_t * galloc(void);
+static void gdrop(void);
+static struct gframe * gpush(struct gterm_t *, unsigned int);
+static void gloose(struct gterm_t *);
+static struct gterm_t * gfrom(const struct term_t *);
+static struct term_t * gto(struct gterm_t *);
+static struct gterm_t * ginst(struct gterm_t *, unsigned int, struct gterm_t *);
+static struct gterm_t * gwhnf(struct gterm_t *);
+
+static TLS struct chunk * chunks = NULL;
+static TLS unsigned int chunk_used = CHUNK_SIZE;
+static TLS struct gframe * frames = NULL;
+static TLS unsigned int sp = 0, frames_size = 0;
+
+static struct gterm_t * galloc(void) {
+    if (chunk_used == CHUNK_SIZE) {
+        struct chunk * c = malloc(sizeof(*c));
+        if (!c)
+            tnomem();
+        c->next = chunks;
+        chunks = c;
+        chunk_used = 0;
+    }
+    return &chunks->nodes[chunk_used++];
+}
+
+/* Drops the graph along with the stack, whether or not the evaluation finished. */
+static void gdrop(void) {
+    struct chunk * c;
+    while ((c = chunks)) {
+        chunks = c->next;
+        free(c);
+    }
+    chunk_used = CHUNK_SIZE;
+    free(frames);
+    frames = NULL;
+    sp = frames_size = 0;
+}
+
+static struct gframe * gpush(struct gterm_t * t, unsigned int depth) {
+    struct gframe * f;
+    if (sp == frames_size) {
+        frames_size = frames_size ? frames_size * 2 : 1024;
+        if (!(frames = realloc(frames, frames_size * sizeof(*frames))))
+            tnomem();
+    }
+    f = &frames[sp++];
+    f->t = t;
+    f->g = NULL;
+    f->src = NULL;
+    f->slot = NULL;
+    f->depth = depth;
+    f->n = 0;
+    return f;
+}
+
+/* Works the loose indices of a lambda or an application out from its operands. */
+static void gloose(struct gterm_t * g) {
+    if (g->type == tlambda)
+        g->loose = g->data.lambda_t.body->loose ? g->data.lambda_t.body->loose - 1 : 0;
+    else
+        g->loose = g->data.app_t.left->loose > g->data.app_t.right->loose
+                 ? g->data.app_t.left->loose : g->data.app_t.right->loose;
+}
+
+static struct gterm_t * gfrom(const struct term_t * t) {
+    unsigned int base = sp;
+    struct gterm_t * r;
+    for (;;) {
+        r = galloc();
+        switch ((r->type = t->type)) {
+            case tlambda: {
+                    r->data.lambda_t.var = t->data.lambda_t.var;
+                    gpush(NULL, 0)->g = r;
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    struct gframe * f = gpush(NULL, 0);
+                    f->g = r;
+                    f->src = t;
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            case tvariabl:
+                r->data.var = t->data.var;
+                r->loose = 0;
+                break;
+            case tindex:
+                r->data.index = t->data.index;
+                r->loose = t->data.index + 1;
+                break;
+            default:
+                abort();
+        }
+        /* r is done: hand it to the frame waiting for it. */
+        for (;;) {
+            struct gterm_t * g;
+            if (sp == base)
+                return r;
+            g = frames[sp - 1].g;
+            if (g->type == tapp && !frames[sp - 1].n) {
+                frames[sp - 1].n = 1;
+                g->data.app_t.left = r;
+                t = frames[sp - 1].src->data.app_t.right;
+                break;
+            }
+            sp--;
+            if (g->type == tlambda)
+                g->data.lambda_t.body = r;
+            else
+                g->data.app_t.right = r;
+            gloose(g);
+            r = g;
+        }
+    }
+}
+
+static struct term_t * gto(struct gterm_t * g) {
+    unsigned int base = sp;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        while (g->type == tindirect)
+            g = g->data.target;
+        *slot = p = palloc();
+        switch ((p->type = g->type)) {
+            case tlambda: {
+                    p->data.lambda_t.var = g->data.lambda_t.var;
+                    g = g->data.lambda_t.body;
+                    slot = &p->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    gpush(g->data.app_t.left, 0)->slot = &p->data.app_t.left;
+                    g = g->data.app_t.right;
+                    slot = &p->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+                p->data.var = g->data.var;
+                break;
+            case tindex:
+                p->data.index = g->data.index;
+                break;
+            default:
+                abort();
+        }
+        if (sp == base)
+            return ret;
+        g = frames[--sp].t;
+        slot = frames[sp].slot;
+    }
+}
+
+/* Copies the part of a lambda body that mentions index depth, sharing the rest. */
+static struct gterm_t * ginst(struct gterm_t * t, unsigned int depth, struct gterm_t * arg) {
+    unsigned int base = sp;
+    struct gterm_t * r;
+    for (;;) {
+        if (t->loose <= depth)
+            r = t;
+        else if (t->type == tindex)
+            r = arg;
+        else {
+            struct gframe * f = gpush(t, depth);
+            f->g = r = galloc();
+            if ((r->type = t->type) == tlambda) {
+                r->data.lambda_t.var = t->data.lambda_t.var;
+                t = t->data.lambda_t.body;
+                depth++;
+            } else if (t->type == tapp)
+                t = t->data.app_t.left;
+            else
+                abort();
+            continue;
+        }
+        /* r is done: hand it to the frame waiting for it. */
+        for (;;) {
+            struct gterm_t * g;
+            if (sp == base)
+                return r;
+            g = frames[sp - 1].g;
+            if (g->type == tapp && !frames[sp - 1].n) {
+                frames[sp - 1].n = 1;
+                g->data.app_t.left = r;
+                t = frames[sp - 1].t->data.app_t.right;
+                depth = frames[sp - 1].depth;
+                break;
+            }
+            sp--;
+            if (g->type == tlambda)
+                g->data.lambda_t.body = r;
+            else
+                g->data.app_t.right = r;
+            gloose(g);
+            r = g;
+        }
+    }
+}
+
+/* Stops early once the budget runs out, with the root as the partial result. */
+static struct gterm_t * gwhnf(struct gterm_t * g) {
+    unsigned int base = sp;
+    struct gterm_t * root = g;
+    for (;;)
+        switch (g->type) {
+            case tindirect: {
+                    g = g->data.target;
+                    continue;
+                }
+            case tapp: {
+                    gpush(g, 0);
+                    STATMAX(spine, sp - base);
+                    g = g->data.app_t.left;
+                    continue;
+                }
+            case tlambda: {
+                    struct gterm_t * redex;
+                    if (sp == base)
+                        return g;
+                    if (!tspend()) {
+                        sp = base;
+                        return root;
+                    }
+                    redex = frames[--sp].t;
+                    STAT(betas);
+                    g = ginst(g->data.lambda_t.body, 0, redex->data.app_t.right);
+                    redex->type = tindirect;
+                    redex->data.target = g;
+                    continue;
+                }
+            case tvariabl: {
+                    if (sp > base)
+                        g = frames[base].t;
+                    sp = base;
+                    return g;
+                }
+            default:
+                abort();
+        }
+}
+
+void evalbneed(struct term_t ** ppterm) {
+    struct gterm_t * g;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tdbruijn(*ppterm);
+    g = gfrom(*ppterm);
+    tfparse(*ppterm);
+    *ppterm = gto(gwhnf(g));
+    gdrop();
+    tnamed(*ppterm);
+}
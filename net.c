@@ -0,0 +1,433 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lambda.h"
+
+/* Optimal reduction on interaction nets: Lamping's algorithm without the bracket
+ * and croissant nodes, also known as the abstract algorithm. A lambda, an
+ * application and a fan that shares a variable are each a node with a principal
+ * port and two auxiliary ones, and a beta step is the rewrite of a lambda and an
+ * application facing each other. Fans duplicate what they meet one node at a
+ * time, so a redex inside a shared lambda body is contracted once for all of its
+ * copies.
+ *
+ * Every binder labels the fans sharing its variable, and fans only annihilate on
+ * equal labels. That reads back right for terms which are typable in elementary
+ * affine logic, Church arithmetic among them. Other terms can tangle the net: its
+ * fans may go on copying each other, or read-back may run into a cycle of fans,
+ * enter a lambda it is already inside of, or reach a variable outside the lambdas
+ * it has entered. Such a term, and one whose net grows GROWTH times past its
+ * encoding, is handed to the De Bruijn evaluator instead. Every interaction is
+ * charged to the budget, and a term that runs out of it is handed over as well.
+ *
+ * Reduction is lazy: read-back asks for the node on the far end of a wire, and
+ * only the active pairs met on the way there are rewritten. */
+enum {
+    nroot,
+    nlam,
+    napp,
+    ndup,
+    nera,
+    natom
+};
+
+/* Port 0 is the principal one. A lambda has its variable on 1 and its body on 2,
+ * an application its result on 1 and its argument on 2. The label is the fan
+ * label, or the level of a lambda on read-back. */
+struct inode {
+    unsigned int port[3];
+    int kind;
+    unsigned int label;
+    char var;
+};
+
+/* An exit taken through a fan on read-back, to leave by when the same path meets
+ * a fan from its principal side. depth counts the exits taken so far, and more of
+ * them than there are nodes went round in circles. */
+struct iexit {
+    unsigned int slot, next, depth;
+};
+
+/* A right operand still to be built or read back, with the exits to leave it by
+ * and the top of the exit stack when it was put aside. */
+struct iframe {
+    const struct term_t * term;
+    unsigned int port, exits, exitp, depth;
+    struct term_t ** slot;
+};
+
+#define PORT(n, s) ((n) << 2 | (s))
+#define NODE(p) ((p) >> 2)
+#define SLOT(p) ((p) & 3)
+#define UNLINKED 0xFFFFFFFFu
+#define GROWTH 64
+#define GROWTH_FLOOR (1u << 20)
+#define NODES_MAX (1u << 29)
+
+static unsigned int nalloc(int, unsigned int);
+static void nrelease(unsigned int);
+static void wire(unsigned int, unsigned int);
+static void replace(unsigned int, unsigned int);
+static void join(unsigned int, unsigned int);
+static bool rule(unsigned int, unsigned int);
+static void interact(unsigned int, unsigned int);
+static unsigned int whnf(unsigned int);
+static void nencode(const struct term_t *);
+static struct term_t * nread(void);
+
+static TLS struct inode * nodes = NULL;
+static TLS unsigned int nodes_used = 0, nodes_size = 0, free_nodes = 0, nodes_cap;
+static TLS unsigned int * path = NULL;
+static TLS unsigned int pathp = 0, path_size = 0, trail = 0;
+static TLS bool tangled;
+
+static void * grow(void * p, unsigned int * size, size_t item, unsigned int first) {
+    *size = *size ? *size * 2 : first;
+    if (!(p = realloc(p, *size * item)))
+        tnomem();
+    return p;
+}
+
+/* Node 0 is the root, so 0 also ends the free list. */
+static unsigned int nalloc(int kind, unsigned int label) {
+    unsigned int n = free_nodes;
+    if (n)
+        free_nodes = nodes[n].port[0];
+    else {
+        if (nodes_used == nodes_size)
+            nodes = grow(nodes, &nodes_size, sizeof(*nodes), 4096);
+        n = nodes_used++;
+    }
+    nodes[n].kind = kind;
+    nodes[n].label = label;
+    return n;
+}
+
+static void nrelease(unsigned int n) {
+    nodes[n].port[0] = free_nodes;
+    free_nodes = n;
+}
+
+static void wire(unsigned int a, unsigned int b) {
+    nodes[NODE(a)].port[SLOT(a)] = b;
+    nodes[NODE(b)].port[SLOT(b)] = a;
+}
+
+/* Puts the new port n where the port p of a node about to go was. If p is wired
+ * to another port about to go, that one now points at n and is replaced in turn. */
+static void replace(unsigned int p, unsigned int n) {
+    wire(n, nodes[NODE(p)].port[SLOT(p)]);
+}
+
+/* Wires together whatever the ports a and b of nodes about to go were wired to. */
+static void join(unsigned int a, unsigned int b) {
+    wire(nodes[NODE(a)].port[SLOT(a)], nodes[NODE(b)].port[SLOT(b)]);
+}
+
+static bool rule(unsigned int a, unsigned int b) {
+    int ka = nodes[a].kind, kb = nodes[b].kind;
+    if (ka == nroot || kb == nroot)
+        return false;
+    if (ka == natom || kb == natom)
+        return ka != nlam && ka != napp && kb != nlam && kb != napp;
+    return true;
+}
+
+static void interact(unsigned int a, unsigned int b) {
+    unsigned int a1, a2, b1, b2;
+    if (nodes[a].kind > nodes[b].kind)
+        a1 = a, a = b, b = a1;
+    if (nodes[a].kind == nlam && nodes[b].kind == napp) {
+        STAT(betas);
+        join(PORT(a, 2), PORT(b, 1));
+        join(PORT(a, 1), PORT(b, 2));
+    } else if (nodes[b].kind == nera || nodes[b].kind == natom) {
+        if (nodes[a].kind != nera && nodes[a].kind != natom) {
+            a1 = nalloc(nodes[b].kind, 0);
+            a2 = nalloc(nodes[b].kind, 0);
+            nodes[a1].var = nodes[a2].var = nodes[b].var;
+            replace(PORT(a, 1), PORT(a1, 0));
+            replace(PORT(a, 2), PORT(a2, 0));
+        }
+    } else if (nodes[a].kind == nodes[b].kind && nodes[a].label == nodes[b].label) {
+        join(PORT(a, 1), PORT(b, 1));
+        join(PORT(a, 2), PORT(b, 2));
+    } else {
+        STAT(copies);
+        a1 = nalloc(nodes[a].kind, nodes[a].label);
+        a2 = nalloc(nodes[a].kind, nodes[a].label);
+        b1 = nalloc(nodes[b].kind, nodes[b].label);
+        b2 = nalloc(nodes[b].kind, nodes[b].label);
+        nodes[a1].var = nodes[a2].var = nodes[a].var;
+        nodes[b1].var = nodes[b2].var = nodes[b].var;
+        wire(PORT(b1, 1), PORT(a1, 1));
+        wire(PORT(b1, 2), PORT(a2, 1));
+        wire(PORT(b2, 1), PORT(a1, 2));
+        wire(PORT(b2, 2), PORT(a2, 2));
+        replace(PORT(a, 1), PORT(b1, 0));
+        replace(PORT(a, 2), PORT(b2, 0));
+        replace(PORT(b, 1), PORT(a1, 0));
+        replace(PORT(b, 2), PORT(a2, 0));
+    }
+    nrelease(a);
+    nrelease(b);
+}
+
+/* Rewrites the active pairs between the port w and the node it leads to, walking
+ * from the result of an application to its function and from the copies of a fan
+ * to what it shares. Returns the port on the far end. Running out of budget or
+ * past nodes_cap sets tangled, and so does a walk longer than the net, which went
+ * round in circles.
+ *
+ * The walk is kept on path, ending with the port it stopped at. Read-back goes on
+ * through a fan to the next port of that walk, which is settled already, so such
+ * a call steps along path instead of walking the rest of a chain of fans again. */
+static unsigned int whnf(unsigned int w) {
+    unsigned int start = w;
+    if (trail + 1 < pathp && path[trail + 1] == w) {
+        trail++;
+        return nodes[NODE(w)].port[SLOT(w)];
+    }
+    pathp = trail = 0;
+    for (;;) {
+        unsigned int q = nodes[NODE(w)].port[SLOT(w)];
+        int kind = nodes[NODE(q)].kind;
+        if (SLOT(q) == 0) {
+            if (pathp && rule(NODE(w), NODE(q))) {
+                if (nodes_used > nodes_cap || !tspend()) {
+                    tangled = true;
+                    break;
+                }
+                interact(NODE(w), NODE(q));
+                w = path[--pathp];
+                continue;
+            }
+        } else if (kind == ndup || (kind == napp && SLOT(q) == 1)) {
+            if (pathp > nodes_used) {
+                tangled = true;
+                break;
+            }
+            if (pathp == path_size)
+                path = grow(path, &path_size, sizeof(*path), 1024);
+            path[pathp++] = w;
+            STATMAX(spine, pathp);
+            w = PORT(NODE(q), 0);
+            continue;
+        }
+        break;
+    }
+    if (pathp == path_size)
+        path = grow(path, &path_size, sizeof(*path), 1024);
+    path[pathp++] = w;
+    return nodes[NODE(start)].port[SLOT(start)];
+}
+
+/* Builds the net of a De Bruijn term under the root. A variable used more than
+ * once is shared by a chain of fans labelled after its binder, and an unused one
+ * is erased. */
+static void nencode(const struct term_t * t) {
+    struct iframe * frames = NULL;
+    unsigned int * binders = NULL;
+    unsigned int fp = 0, frames_size = 0, binders_size = 0, depth = 0, dst = PORT(0, 0), labels = 0, n;
+    for (;;) {
+        switch (t->type) {
+            case tlambda: {
+                    n = nalloc(nlam, labels++);
+                    nodes[n].var = t->data.lambda_t.var;
+                    nodes[n].port[1] = UNLINKED;
+                    wire(PORT(n, 0), dst);
+                    if (depth == binders_size)
+                        binders = grow(binders, &binders_size, sizeof(*binders), 64);
+                    binders[depth++] = n;
+                    dst = PORT(n, 2);
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    n = nalloc(napp, 0);
+                    wire(PORT(n, 1), dst);
+                    if (fp == frames_size)
+                        frames = grow(frames, &frames_size, sizeof(*frames), 64);
+                    frames[fp].port = PORT(n, 2);
+                    frames[fp].depth = depth;
+                    frames[fp++].term = t->data.app_t.right;
+                    dst = PORT(n, 0);
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            case tindex: {
+                    unsigned int b = binders[depth - 1 - t->data.index];
+                    if (nodes[b].port[1] == UNLINKED)
+                        wire(PORT(b, 1), dst);
+                    else {
+                        n = nalloc(ndup, nodes[b].label);
+                        wire(PORT(n, 1), nodes[b].port[1]);
+                        wire(PORT(n, 2), dst);
+                        wire(PORT(n, 0), PORT(b, 1));
+                    }
+                    break;
+                }
+            case tvariabl: {
+                    n = nalloc(natom, 0);
+                    nodes[n].var = t->data.var;
+                    wire(PORT(n, 0), dst);
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (!fp)
+            break;
+        dst = frames[--fp].port;
+        depth = frames[fp].depth;
+        t = frames[fp].term;
+    }
+    for (n = 1; n < nodes_used; n++)
+        if (nodes[n].kind == nlam && nodes[n].port[1] == UNLINKED)
+            wire(PORT(n, 1), PORT(nalloc(nera, 0), 0));
+    free(frames);
+    free(binders);
+}
+
+/* Reads the normal form back from the root, or returns NULL if the net is tangled.
+ * binders holds the lambdas on the way down, so a variable can be checked to lead
+ * to one of them, and a lambda to be none of them. */
+static struct term_t * nread(void) {
+    struct iframe * frames = NULL;
+    struct iexit * exits = NULL;
+    unsigned int * binders = NULL;
+    unsigned int fp = 0, frames_size = 0, exitp = 1, exits_size = 0, binders_size = 0;
+    unsigned int w = PORT(0, 0), ex = 0, depth = 0, q, n;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        q = whnf(w);
+        if (tangled)
+            break;
+        n = NODE(q);
+        switch (nodes[n].kind) {
+            case ndup: {
+                    if (SLOT(q) == 0) {
+                        if (!ex) {
+                            tangled = true;
+                            break;
+                        }
+                        w = PORT(n, exits[ex].slot);
+                        ex = exits[ex].next;
+                    } else {
+                        if (ex && exits[ex].depth >= nodes_used) {
+                            tangled = true;
+                            break;
+                        }
+                        if (exitp >= exits_size)
+                            exits = grow(exits, &exits_size, sizeof(*exits), 1024);
+                        exits[exitp].slot = SLOT(q);
+                        exits[exitp].next = ex;
+                        exits[exitp].depth = ex ? exits[ex].depth + 1 : 1;
+                        ex = exitp++;
+                        w = PORT(n, 0);
+                    }
+                    continue;
+                }
+            case nlam: {
+                    if (SLOT(q) == 2) {
+                        tangled = true;
+                        break;
+                    }
+                    if ((nodes[n].label < depth && binders[nodes[n].label] == n) != (SLOT(q) == 1)) {
+                        tangled = true;
+                        break;
+                    }
+                    p = *slot = palloc();
+                    if (SLOT(q) == 1) {
+                        p->type = tindex;
+                        p->data.index = depth - 1 - nodes[n].label;
+                        break;
+                    }
+                    p->type = tlambda;
+                    p->data.lambda_t.var = nodes[n].var;
+                    if (depth == binders_size)
+                        binders = grow(binders, &binders_size, sizeof(*binders), 64);
+                    binders[depth] = n;
+                    nodes[n].label = depth++;
+                    slot = &p->data.lambda_t.body;
+                    w = PORT(n, 2);
+                    continue;
+                }
+            case napp: {
+                    if (SLOT(q) != 1) {
+                        tangled = true;
+                        break;
+                    }
+                    p = *slot = palloc();
+                    p->type = tapp;
+                    if (fp == frames_size)
+                        frames = grow(frames, &frames_size, sizeof(*frames), 64);
+                    frames[fp].port = PORT(n, 2);
+                    frames[fp].exits = ex;
+                    frames[fp].exitp = exitp;
+                    frames[fp].depth = depth;
+                    frames[fp++].slot = &p->data.app_t.right;
+                    slot = &p->data.app_t.left;
+                    w = PORT(n, 0);
+                    continue;
+                }
+            case natom: {
+                    p = *slot = palloc();
+                    p->type = tvariabl;
+                    p->data.var = nodes[n].var;
+                    break;
+                }
+            default:
+                abort();
+        }
+        if (tangled || !fp)
+            break;
+        w = frames[--fp].port;
+        ex = frames[fp].exits;
+        exitp = frames[fp].exitp;
+        depth = frames[fp].depth;
+        slot = frames[fp].slot;
+    }
+    free(frames);
+    free(exits);
+    free(binders);
+    return tangled ? NULL : ret;
+}
+
+void ievaldeep(struct term_t ** ppterm) {
+    struct term_t * r;
+    tresult = rnormal;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return;
+    tangled = false;
+    nodes_used = free_nodes = pathp = trail = 0;
+    nalloc(nroot, 0);
+    tdbruijn(*ppterm);
+    nencode(*ppterm);
+    nodes_cap = nodes_used < GROWTH_FLOOR / GROWTH ? GROWTH_FLOOR
+        : nodes_used < NODES_MAX / GROWTH ? nodes_used * GROWTH : NODES_MAX;
+    if (!(r = nread())) {
+        tnamed(*ppterm);
+        dbevaldeep(ppterm);
+        return;
+    }
+    tfparse(*ppterm);
+    tnamed(*ppterm = r);
+}
@@ -0,0 +1,440 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "lambda.h"
+
+/* Definitions are normalized as far as DEFINE_FUEL beta steps get them, and are
+ * kept packed with tpack(). Every use unpacks a fresh copy. Those read from text
+ * live in a table sorted by name. Images are mapped as they are and searched
+ * through their own sorted directory, so loading one takes the same time however
+ * many definitions it holds.
+ *
+ * Definitions are made and looked up while parsing, which contexts do on threads
+ * of their own, so the table and the images are behind a lock. Nothing gets
+ * unpacked with it held, as running out of nodes on the way would never let go of
+ * it. */
+#define DEFINE_FUEL 100000
+#define IMAGE_VERSION 1
+
+struct definition {
+    const char * name;
+    unsigned int length, size, rank;
+    const unsigned int * words;
+};
+
+/* An image is a header, a directory of count entries sorted by name, the names
+ * and the packed terms. Offsets are in bytes from the start of the image. */
+struct header {
+    char magic[4];
+    unsigned int version, count, reserved;
+};
+
+struct entry {
+    unsigned int name, length, words, size;
+};
+
+struct image {
+    const unsigned char * base;
+    size_t length;
+    unsigned int count;
+};
+
+static const char magic[4] = { 'L', 'C', 'P', 'I' };
+
+static int dcompare(const char *, unsigned int, const char *, unsigned int);
+static int dorder(const void *, const void *);
+static unsigned int dfind(const char *, unsigned int, bool *);
+static const unsigned int * dimage(const struct image *, const char *, unsigned int, unsigned int *);
+static bool dvalid(const unsigned int *, unsigned int);
+static bool dmap(int, const char *);
+
+static struct definition * table = NULL;
+static unsigned int ndefs = 0, table_size = 0;
+static struct image * images = NULL;
+static unsigned int nimages = 0;
+static unsigned long generation = 0;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int dcompare(const char * a, unsigned int alength, const char * b, unsigned int blength) {
+    int r = memcmp(a, b, alength < blength ? alength : blength);
+    if (r)
+        return r;
+    return alength < blength ? -1 : alength > blength;
+}
+
+static int dorder(const void * a, const void * b) {
+    const struct definition * x = a, * y = b;
+    int r = dcompare(x->name, x->length, y->name, y->length);
+    if (r)
+        return r;
+    return x->rank < y->rank ? -1 : x->rank > y->rank;
+}
+
+/* Returns where name is in the table, or where it would go. */
+static unsigned int dfind(const char * name, unsigned int length, bool * found) {
+    unsigned int lo = 0, hi = ndefs;
+    *found = false;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        int r = dcompare(name, length, table[mid].name, table[mid].length);
+        if (!r) {
+            *found = true;
+            return mid;
+        }
+        if (r < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Looks name up in an image, and checks the bounds of what it finds. */
+static const unsigned int * dimage(const struct image * img, const char * name, unsigned int length, unsigned int * size) {
+    const struct entry * dir = (const struct entry *) (img->base + sizeof(struct header));
+    unsigned int lo = 0, hi = img->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        const struct entry * e = &dir[mid];
+        int r;
+        if (e->name > img->length || e->length > img->length - e->name)
+            return NULL;
+        r = dcompare(name, length, (const char *) img->base + e->name, e->length);
+        if (r < 0)
+            hi = mid;
+        else if (r > 0)
+            lo = mid + 1;
+        else {
+            if (e->words % sizeof(unsigned int) || e->words > img->length
+                    || e->size > (img->length - e->words) / sizeof(unsigned int))
+                return NULL;
+            *size = e->size;
+            return (const unsigned int *) (img->base + e->words);
+        }
+    }
+    return NULL;
+}
+
+/* Checks that words hold exactly one closed term. */
+static bool dvalid(const unsigned int * words, unsigned int size) {
+    unsigned int * depths = malloc((size + 1) * sizeof(*depths)), n = 0, i;
+    bool ok = true;
+    if (!depths)
+        tnomem();
+    depths[n++] = 0;
+    for (i = 0; ok && i < size; i++) {
+        unsigned int depth, w = words[i];
+        if (!n) {
+            ok = false;
+            break;
+        }
+        depth = depths[--n];
+        switch (w & 3) {
+            case wlam:
+                depths[n++] = depth + 1;
+                break;
+            case wapp:
+                depths[n++] = depth;
+                depths[n++] = depth;
+                break;
+            case widx:
+                ok = w >> 2 < depth;
+                break;
+            default:
+                if (w == WNUMBER)
+                    ok = (i += 2) < size;
+                else
+                    ok = w >> 2 > 256;
+        }
+    }
+    free(depths);
+    return ok && !n;
+}
+
+struct term_t * tlookup(const char * name, size_t length) {
+    const unsigned int * words = NULL;
+    unsigned int size, i, * copy = NULL;
+    struct term_t * t;
+    bool found;
+    if (length > 255)
+        return NULL;
+    pthread_rwlock_rdlock(&lock);
+    i = dfind(name, length, &found);
+    if (found) {
+        words = table[i].words;
+        size = table[i].size;
+    }
+    for (i = nimages; !words && i-- > 0; )
+        if ((words = dimage(&images[i], name, length, &size)) && !dvalid(words, size))
+            words = NULL;
+    if (words && (copy = malloc(size * sizeof(*copy))))
+        memcpy(copy, words, size * sizeof(*copy));
+    pthread_rwlock_unlock(&lock);
+    if (!words)
+        return NULL;
+    if (!copy)
+        tnomem();
+    t = tunpack(copy);
+    free(copy);
+    tnamed(t);
+    return t;
+}
+
+bool tdefine(const char * name, size_t length, struct term_t * t) {
+    static const struct bitmap empty = EMPTY_BITMAP;
+    struct stats saved = tstats;
+    struct term_t * normal;
+    unsigned int * words, i;
+    size_t size;
+    char * copy;
+    bool found;
+    if (memcmp(&t->free_vars, &empty, sizeof(empty))) {
+        terror = "Definition has free variables.";
+        return false;
+    }
+    normal = tcparse(t);
+    tlimit(DEFINE_FUEL, 0);
+    evaldeep(&normal);
+    if (tresult == rnormal)
+        t = normal;
+    tstats = saved;
+    tdbruijn(t);
+    words = tpack(t, &size);
+    pthread_rwlock_wrlock(&lock);
+    i = dfind(name, length, &found);
+    if (found) {
+        free((void *) table[i].words);
+        table[i].words = words;
+        table[i].size = size;
+        generation++;
+        pthread_rwlock_unlock(&lock);
+        return true;
+    }
+    if (ndefs == table_size) {
+        struct definition * grown;
+        if (!(grown = realloc(table, (table_size ? table_size * 2 : 64) * sizeof(*table)))) {
+            pthread_rwlock_unlock(&lock);
+            tnomem();
+        }
+        table = grown;
+        table_size = table_size ? table_size * 2 : 64;
+    }
+    if (!(copy = malloc(length))) {
+        pthread_rwlock_unlock(&lock);
+        tnomem();
+    }
+    memcpy(copy, name, length);
+    memmove(&table[i + 1], &table[i], (ndefs++ - i) * sizeof(*table));
+    table[i].name = copy;
+    table[i].length = length;
+    table[i].words = words;
+    table[i].size = size;
+    generation++;
+    pthread_rwlock_unlock(&lock);
+    return true;
+}
+
+static bool dmap(int fd, const char * path) {
+    struct header h;
+    struct stat st;
+    void * map;
+    if (fstat(fd, &st) || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        return false;
+    memcpy(&h, map, sizeof(h));
+    if (h.version != IMAGE_VERSION || h.count > (st.st_size - sizeof(h)) / sizeof(struct entry)) {
+        fprintf(stderr, "%s: Unsupported prelude image.\n", path);
+        munmap(map, st.st_size);
+        return true;
+    }
+    pthread_rwlock_wrlock(&lock);
+    if (!(images = realloc(images, (nimages + 1) * sizeof(*images)))) {
+        pthread_rwlock_unlock(&lock);
+        tnomem();
+    }
+    images[nimages].base = map;
+    images[nimages].length = st.st_size;
+    images[nimages++].count = h.count;
+    generation++;
+    pthread_rwlock_unlock(&lock);
+    return true;
+}
+
+/* Loads a prelude image, or a prelude text of definitions. Problems with single
+ * definitions are reported on stderr; false means the file couldn't be read. */
+bool tprelude(const char * path) {
+    char head[sizeof(struct header)];
+    struct source * src;
+    struct term_t * t;
+    int fd = open(path, O_RDONLY);
+    bool ok;
+    if (fd < 0)
+        return false;
+    if (read(fd, head, sizeof(head)) == sizeof(head) && !memcmp(head, magic, sizeof(magic))) {
+        ok = dmap(fd, path);
+        close(fd);
+        return ok;
+    }
+    close(fd);
+    if (!(src = sopen(path)))
+        return false;
+    while (tsparse(src, &t)) {
+        if (!t)
+            fprintf(stderr, "%s: %s\n", path, terror);
+        else {
+            fprintf(stderr, "%s: A term in a prelude is not a definition.\n", path);
+            tfparse(t);
+        }
+        treset();
+    }
+    sclose(src);
+    treset();
+    return true;
+}
+
+/* Hands fn a copy of the packed term of every definition made or loaded so far,
+ * shadowed ones included, unless nothing was defined or loaded since generation
+ * since. The copies are fn's to free. Returns the generation they are from. */
+unsigned long tdefinitions(unsigned long since, void (*fn)(unsigned int *, unsigned int, void *), void * arg) {
+    struct definition * defs;
+    unsigned long now;
+    unsigned int n, i, j;
+    pthread_rwlock_rdlock(&lock);
+    if ((now = generation) == since) {
+        pthread_rwlock_unlock(&lock);
+        return now;
+    }
+    for (i = 0, n = ndefs; i < nimages; i++)
+        n += images[i].count;
+    if (!(defs = malloc((n + 1) * sizeof(*defs)))) {
+        pthread_rwlock_unlock(&lock);
+        tnomem();
+    }
+    for (i = n = 0; i < ndefs; i++)
+        defs[n++] = table[i];
+    for (i = 0; i < nimages; i++) {
+        const struct entry * dir = (const struct entry *) (images[i].base + sizeof(struct header));
+        for (j = 0; j < images[i].count; j++) {
+            const char * name = (const char *) images[i].base + dir[j].name;
+            if (dir[j].name > images[i].length || dir[j].length > images[i].length - dir[j].name)
+                continue;
+            if ((defs[n].words = dimage(&images[i], name, dir[j].length, &defs[n].size))
+                    && dvalid(defs[n].words, defs[n].size))
+                n++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        unsigned int * copy = malloc(defs[i].size * sizeof(*copy));
+        if (!copy) {
+            while (i--)
+                free((void *) defs[i].words);
+            free(defs);
+            pthread_rwlock_unlock(&lock);
+            tnomem();
+        }
+        defs[i].words = memcpy(copy, defs[i].words, defs[i].size * sizeof(*copy));
+    }
+    pthread_rwlock_unlock(&lock);
+    for (i = 0; i < n; i++)
+        fn((unsigned int *) defs[i].words, defs[i].size, arg);
+    free(defs);
+    return now;
+}
+
+/* Writes every definition made or loaded so far to an image. */
+bool tsnapshot(const char * path) {
+    struct definition * defs;
+    struct header h;
+    struct entry e;
+    unsigned int n = 0, count = 0, i, j, names, words;
+    const char zero[sizeof(unsigned int)] = { 0 };
+    FILE * f;
+    bool ok;
+    pthread_rwlock_rdlock(&lock);
+    for (i = 0; i < nimages; i++)
+        n += images[i].count;
+    if (!(defs = malloc((n + ndefs + 1) * sizeof(*defs)))) {
+        pthread_rwlock_unlock(&lock);
+        tnomem();
+    }
+    n = 0;
+    for (i = 0; i < ndefs; i++) {
+        defs[n] = table[i];
+        defs[n++].rank = 0;
+    }
+    for (i = nimages; i-- > 0; ) {
+        const struct entry * dir = (const struct entry *) (images[i].base + sizeof(struct header));
+        for (j = 0; j < images[i].count; j++) {
+            const char * name = (const char *) images[i].base + dir[j].name;
+            if (dir[j].name > images[i].length || dir[j].length > images[i].length - dir[j].name)
+                continue;
+            if (!(defs[n].words = dimage(&images[i], name, dir[j].length, &defs[n].size))
+                    || !dvalid(defs[n].words, defs[n].size))
+                continue;
+            defs[n].name = name;
+            defs[n].length = dir[j].length;
+            defs[n++].rank = nimages - i;
+        }
+    }
+    /* Keep the newest of every name. */
+    qsort(defs, n, sizeof(*defs), dorder);
+    for (i = 0; i < n; i++)
+        if (!count || dcompare(defs[i].name, defs[i].length, defs[count - 1].name, defs[count - 1].length))
+            defs[count++] = defs[i];
+    if (!(f = fopen(path, "wb"))) {
+        pthread_rwlock_unlock(&lock);
+        free(defs);
+        return false;
+    }
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = IMAGE_VERSION;
+    h.count = count;
+    h.reserved = 0;
+    fwrite(&h, sizeof(h), 1, f);
+    names = sizeof(h) + count * sizeof(e);
+    for (i = 0, words = names; i < count; i++)
+        words += defs[i].length;
+    words = (words + sizeof(unsigned int) - 1) / sizeof(unsigned int) * sizeof(unsigned int);
+    for (i = 0; i < count; i++) {
+        e.name = names;
+        e.length = defs[i].length;
+        e.words = words;
+        e.size = defs[i].size;
+        names += e.length;
+        words += e.size * sizeof(unsigned int);
+        fwrite(&e, sizeof(e), 1, f);
+    }
+    for (i = 0; i < count; i++)
+        fwrite(defs[i].name, 1, defs[i].length, f);
+    fwrite(zero, 1, (sizeof(unsigned int) - names % sizeof(unsigned int)) % sizeof(unsigned int), f);
+    for (i = 0; i < count; i++)
+        fwrite(defs[i].words, sizeof(unsigned int), defs[i].size, f);
+    pthread_rwlock_unlock(&lock);
+    free(defs);
+    ok = !ferror(f);
+    return !fclose(f) && ok;
+}
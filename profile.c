@@ -0,0 +1,241 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lambda.h"
+
+/* Every lambda read from a named source gets a site holding its position, and its
+ * copies carry the number of the site as their origin. A beta step contracting a
+ * lambda charges the step, and the nodes copied and renamed while substituting,
+ * to the origin of that lambda. Definitions are kept packed, which forgets the
+ * origins, so the lambdas of a definition are charged to a site for its name.
+ * Site 0 takes whatever has no origin: lambdas built by the evaluators themselves
+ * and those read from text in memory.
+ *
+ * Threads count into arrays of their own, indexed by origin, and add them to the
+ * sites once they are done. The origin of a lambda shares its parser frame with
+ * the binder, so there are at most SITES_MAX sites; lambdas past that get none. */
+#define SITES_MAX ((1U << 24) - 1)
+#define DEF_BUCKETS 1024
+
+struct site {
+    const char * file;
+    unsigned long line, column;
+    struct ucount total;
+    unsigned int next;
+};
+
+static void sreserve(void);
+static unsigned int sadd(const char *, unsigned long, unsigned long);
+static int scompare(const void *, const void *);
+
+bool uprofiling = false;
+TLS struct ucount * ucharged = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct site * sites = NULL;
+static unsigned int nsites = 0, sites_size = 0;
+static unsigned int defs[DEF_BUCKETS];
+
+static TLS struct ucount * counts = NULL;
+static TLS unsigned int ncounts = 0;
+
+/* Makes room for one more site past site 0. Called with the lock held, like sadd;
+ * both drop it before running out of memory. */
+static void sreserve(void) {
+    struct site * grown;
+    if (nsites && nsites < sites_size)
+        return;
+    if (!(grown = realloc(sites, (sites_size ? sites_size * 2 : 1024) * sizeof(*sites)))) {
+        pthread_mutex_unlock(&lock);
+        tnomem();
+    }
+    sites = grown;
+    sites_size = sites_size ? sites_size * 2 : 1024;
+    if (!nsites)
+        memset(&sites[nsites++], 0, sizeof(*sites));
+}
+
+static unsigned int sadd(const char * file, unsigned long line, unsigned long column) {
+    if (nsites > SITES_MAX)
+        return 0;
+    sreserve();
+    memset(&sites[nsites], 0, sizeof(*sites));
+    sites[nsites].file = file;
+    sites[nsites].line = line;
+    sites[nsites].column = column;
+    return nsites++;
+}
+
+/* The name of the file has to outlive the report. */
+unsigned int usite(const char * file, unsigned long line, unsigned long column) {
+    unsigned int i;
+    pthread_mutex_lock(&lock);
+    i = sadd(file, line, column);
+    pthread_mutex_unlock(&lock);
+    return i;
+}
+
+/* Gives every lambda of the unpacked definition t the site of its name. */
+void ustamp(struct term_t * t, const char * name, size_t length) {
+    struct term_t ** stack = NULL;
+    unsigned int sp = 0, size = 0, hash = 2166136261U, i;
+    char * label;
+    size_t k;
+    for (k = 0; k < length; k++)
+        hash = (hash ^ (unsigned char) name[k]) * 16777619U;
+    pthread_mutex_lock(&lock);
+    for (i = defs[hash % DEF_BUCKETS]; i; i = sites[i].next)
+        if (!strncmp(sites[i].file + 1, name, length) && sites[i].file[length + 1] == ']')
+            break;
+    if (!i) {
+        if (!(label = malloc(length + 3))) {
+            pthread_mutex_unlock(&lock);
+            tnomem();
+        }
+        label[0] = '[';
+        memcpy(label + 1, name, length);
+        memcpy(label + length + 1, "]", 2);
+        if ((i = sadd(label, 0, 0))) {
+            sites[i].next = defs[hash % DEF_BUCKETS];
+            defs[hash % DEF_BUCKETS] = i;
+        } else
+            free(label);
+    }
+    pthread_mutex_unlock(&lock);
+    for (;;) {
+        switch (t->type) {
+            case tlambda: {
+                    t->origin = i;
+                    t = t->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    if (sp == size) {
+                        size = size ? size * 2 : 64;
+                        if (!(stack = realloc(stack, size * sizeof(*stack))))
+                            tnomem();
+                    }
+                    stack[sp++] = t->data.app_t.right;
+                    t = t->data.app_t.left;
+                    continue;
+                }
+            default:
+                break;
+        }
+        if (!sp)
+            break;
+        t = stack[--sp];
+    }
+    free(stack);
+}
+
+/* Starts charging the thread's work to origin, until ucharged is cleared. */
+void ucharge(unsigned int origin) {
+    if (origin >= ncounts) {
+        unsigned int size = ncounts ? ncounts : 1024;
+        struct ucount * grown;
+        while (size <= origin)
+            size *= 2;
+        if (!(grown = realloc(counts, size * sizeof(*counts))))
+            tnomem();
+        memset(&grown[ncounts], 0, (size - ncounts) * sizeof(*grown));
+        counts = grown;
+        ncounts = size;
+    }
+    ucharged = &counts[origin];
+    ucharged->betas++;
+}
+
+/* Adds what the thread counted to the sites. Every thread that evaluated terms
+ * calls it before it exits. */
+void uflush(void) {
+    unsigned int i;
+    ucharged = NULL;
+    if (!counts)
+        return;
+    pthread_mutex_lock(&lock);
+    sreserve();
+    for (i = 0; i < ncounts && i < nsites; i++) {
+        sites[i].total.betas += counts[i].betas;
+        sites[i].total.copies += counts[i].copies;
+        sites[i].total.renames += counts[i].renames;
+    }
+    pthread_mutex_unlock(&lock);
+    free(counts);
+    counts = NULL;
+    ncounts = 0;
+}
+
+static int scompare(const void * a, const void * b) {
+    const struct ucount * x = &(*(const struct site * const *) a)->total;
+    const struct ucount * y = &(*(const struct site * const *) b)->total;
+    if (x->betas != y->betas)
+        return x->betas < y->betas ? 1 : -1;
+    if (x->copies != y->copies)
+        return x->copies < y->copies ? 1 : -1;
+    if (x->renames != y->renames)
+        return x->renames < y->renames ? 1 : -1;
+    return 0;
+}
+
+/* Writes the sites that were charged anything to path, most betas first: as a
+ * table, or as folded stacks of beta steps for flame graph tools. False means the
+ * file couldn't be written. */
+bool ureport(const char * path, bool folded) {
+    struct site ** order = NULL;
+    unsigned int n = 0, i;
+    FILE * out;
+    bool ok;
+    if (!(out = fopen(path, "w")))
+        return false;
+    pthread_mutex_lock(&lock);
+    if (nsites && !(order = malloc(nsites * sizeof(*order)))) {
+        pthread_mutex_unlock(&lock);
+        tnomem();
+    }
+    for (i = 0; i < nsites; i++)
+        if (sites[i].total.betas || sites[i].total.copies || sites[i].total.renames)
+            order[n++] = &sites[i];
+    qsort(order, n, sizeof(*order), scompare);
+    if (!folded)
+        fprintf(out, "%12s %12s %12s  %s\n", "betas", "copies", "renames", "lambda");
+    for (i = 0; i < n; i++) {
+        struct site * s = order[i];
+        if (folded && !s->total.betas)
+            continue;
+        if (!folded)
+            fprintf(out, "%12lu %12lu %12lu  ", s->total.betas, s->total.copies, s->total.renames);
+        if (s == &sites[0])
+            fputs("(other)", out);
+        else if (!s->line)
+            fputs(s->file, out);
+        else
+            fprintf(out, folded ? "%s;%lu:%lu" : "%s:%lu:%lu", s->file, s->line, s->column);
+        if (folded)
+            fprintf(out, " %lu", s->total.betas);
+        putc('\n', out);
+    }
+    pthread_mutex_unlock(&lock);
+    free(order);
+    ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
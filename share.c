@@ -0,0 +1,625 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "lambda.h"
+
+#define CHUNK_SIZE 4096
+
+/* Hash-consed De Bruijn terms. Every distinct (type, hint, children) triple exists
+ * once, nodes are immutable and live as long as their reference count is non-zero.
+ * loose is one more than the largest index pointing out of the term, so that
+ * substitution can skip subterms it cannot change. */
+struct sterm_t {
+    int type;
+    unsigned int refs, hash, loose;
+    struct sterm_t * chain;
+    union {
+        struct {
+            char var;
+            struct sterm_t * body;
+        } lambda_t;
+        struct {
+            struct sterm_t * left;
+            struct sterm_t * right;
+        } app_t;
+        char var;
+        unsigned int index;
+    } data;
+};
+
+/* Nodes are carved out of chunks, which stay with the thread until shclear(). */
+struct chunk {
+    struct chunk * next;
+    struct sterm_t nodes[CHUNK_SIZE];
+};
+
+/* Results of the current substitution or shift, keyed by node, depth and the
+ * amount shifted by, since one substitution shifts its argument by the depth of
+ * every occurrence. Entries don't own a reference: the result they point to is
+ * kept alive by the term being built. Bumping gen empties the table. */
+struct memo {
+    struct entry {
+        const struct sterm_t * key;
+        unsigned int depth, shift, gen;
+        struct sterm_t * value;
+    } * t;
+    unsigned int size, count, gen;
+};
+
+/* Pending work of the traversals below, none of which recurse on the C stack: a
+ * node waiting for its operands, the result of its left operand once that is done
+ * (n = 1), and the binders above it. Converting from and to term_t uses src and
+ * slot instead. A traversal only ever pops the frames it pushed itself, and must
+ * index the stack afresh after anything that may push, since that may move it. */
+struct sframe {
+    struct sterm_t * t, * r;
+    const struct term_t * src;
+    struct term_t ** slot;
+    unsigned int depth, n;
+};
+
+static struct sterm_t * salloc(void);
+static unsigned int shash(const struct sterm_t *);
+static bool sequal(const struct sterm_t *, const struct sterm_t *);
+static struct sterm_t * sintern(struct sterm_t *);
+static struct sterm_t * sref(struct sterm_t *);
+static void srelease(struct sterm_t *);
+static struct sterm_t * slambda(char, struct sterm_t *);
+static struct sterm_t * sapp(struct sterm_t *, struct sterm_t *);
+static struct sterm_t * sleaf(int, char, unsigned int);
+static struct sframe * spush(struct sterm_t *, unsigned int);
+static struct sterm_t ** mfind(struct memo *, const struct sterm_t *, unsigned int, unsigned int);
+static struct sterm_t * swalk(struct sterm_t *, unsigned int, unsigned int, struct sterm_t *);
+static struct sterm_t * sshift(struct sterm_t *, unsigned int, unsigned int);
+static struct sterm_t * ssubst(struct sterm_t *, unsigned int, struct sterm_t *);
+static struct sterm_t * sbeta(struct sterm_t *, struct sterm_t *);
+static struct sterm_t * sbname(struct sterm_t *);
+static struct sterm_t * sbvalue(struct sterm_t *);
+static struct sterm_t * sdeep(struct sterm_t *);
+static struct sterm_t * sfrom(const struct term_t *);
+static struct term_t * sto(struct sterm_t *);
+
+static TLS struct sterm_t ** table = NULL;
+static TLS unsigned int buckets = 0, count = 0;
+static TLS struct chunk * chunks = NULL;
+static TLS struct sterm_t * free_nodes = NULL;
+static TLS struct memo subst_memo = { NULL }, shift_memo = { NULL };
+static TLS struct sframe * frames = NULL;
+static TLS unsigned int sp = 0, frames_size = 0;
+
+static struct sterm_t * salloc(void) {
+    struct sterm_t * t = free_nodes;
+    if (!t) {
+        struct chunk * c = malloc(sizeof(*c));
+        int i;
+        if (!c)
+            tnomem();
+        c->next = chunks;
+        chunks = c;
+        t = c->nodes;
+        for (i = 1; i < CHUNK_SIZE; i++)
+            t[i].chain = i + 1 < CHUNK_SIZE ? &t[i + 1] : NULL;
+        free_nodes = &t[1];
+        return t;
+    }
+    free_nodes = t->chain;
+    return t;
+}
+
+static unsigned int shash(const struct sterm_t * t) {
+    unsigned long h = t->type * 0x9E3779B1UL;
+    switch (t->type) {
+        case tlambda:
+            h ^= (unsigned long) t->data.lambda_t.body + (unsigned char) t->data.lambda_t.var;
+            break;
+        case tapp:
+            h ^= (unsigned long) t->data.app_t.left * 31 + (unsigned long) t->data.app_t.right;
+            break;
+        case tvariabl:
+            h ^= (unsigned char) t->data.var;
+            break;
+        case tindex:
+            h ^= t->data.index * 0x85EBCA6BUL;
+            break;
+        default:
+            abort();
+    }
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DUL;
+    return h ^ h >> 13;
+}
+
+static bool sequal(const struct sterm_t * a, const struct sterm_t * b) {
+    if (a->type != b->type)
+        return false;
+    switch (a->type) {
+        case tlambda:
+            return a->data.lambda_t.var == b->data.lambda_t.var && a->data.lambda_t.body == b->data.lambda_t.body;
+        case tapp:
+            return a->data.app_t.left == b->data.app_t.left && a->data.app_t.right == b->data.app_t.right;
+        case tvariabl:
+            return a->data.var == b->data.var;
+        case tindex:
+            return a->data.index == b->data.index;
+        default:
+            abort();
+    }
+}
+
+/* Takes over the references the prototype holds on its children. */
+static struct sterm_t * sintern(struct sterm_t * proto) {
+    struct sterm_t * t;
+    unsigned int h = shash(proto);
+    if (buckets) {
+        for (t = table[h & (buckets - 1)]; t; t = t->chain)
+            if (t->hash == h && sequal(t, proto)) {
+                if (proto->type == tlambda)
+                    srelease(proto->data.lambda_t.body);
+                else if (proto->type == tapp) {
+                    srelease(proto->data.app_t.left);
+                    srelease(proto->data.app_t.right);
+                }
+                return sref(t);
+            }
+    }
+    if (count >= buckets) {
+        unsigned int i, size = buckets ? buckets * 2 : 1024;
+        struct sterm_t ** grown = calloc(size, sizeof(*grown));
+        if (!grown)
+            tnomem();
+        for (i = 0; i < buckets; i++)
+            while ((t = table[i])) {
+                table[i] = t->chain;
+                t->chain = grown[t->hash & (size - 1)];
+                grown[t->hash & (size - 1)] = t;
+            }
+        free(table);
+        table = grown;
+        buckets = size;
+    }
+    t = salloc();
+    *t = *proto;
+    t->refs = 1;
+    t->hash = h;
+    t->chain = table[h & (buckets - 1)];
+    table[h & (buckets - 1)] = t;
+    count++;
+    return t;
+}
+
+static struct sterm_t * sref(struct sterm_t * t) {
+    t->refs++;
+    return t;
+}
+
+static void srelease(struct sterm_t * t) {
+    unsigned int base = sp;
+    for (;;) {
+        while (t && --t->refs == 0) {
+            struct sterm_t ** p = &table[t->hash & (buckets - 1)], * next = NULL;
+            while (*p != t)
+                p = &(*p)->chain;
+            *p = t->chain;
+            count--;
+            switch (t->type) {
+                case tlambda:
+                    next = t->data.lambda_t.body;
+                    break;
+                case tapp:
+                    spush(t->data.app_t.left, 0);
+                    next = t->data.app_t.right;
+                    break;
+            }
+            t->chain = free_nodes;
+            free_nodes = t;
+            t = next;
+        }
+        if (sp == base)
+            return;
+        t = frames[--sp].t;
+    }
+}
+
+static struct sterm_t * slambda(char var, struct sterm_t * body) {
+    struct sterm_t proto;
+    proto.type = tlambda;
+    proto.loose = body->loose ? body->loose - 1 : 0;
+    proto.data.lambda_t.var = var;
+    proto.data.lambda_t.body = body;
+    return sintern(&proto);
+}
+
+static struct sterm_t * sapp(struct sterm_t * left, struct sterm_t * right) {
+    struct sterm_t proto;
+    proto.type = tapp;
+    proto.loose = left->loose > right->loose ? left->loose : right->loose;
+    proto.data.app_t.left = left;
+    proto.data.app_t.right = right;
+    return sintern(&proto);
+}
+
+static struct sterm_t * sleaf(int type, char var, unsigned int index) {
+    struct sterm_t proto;
+    proto.type = type;
+    if (type == tindex) {
+        proto.loose = index + 1;
+        proto.data.index = index;
+    } else {
+        proto.loose = 0;
+        proto.data.var = var;
+    }
+    return sintern(&proto);
+}
+
+static struct sframe * spush(struct sterm_t * t, unsigned int depth) {
+    struct sframe * f;
+    if (sp == frames_size) {
+        frames_size = frames_size ? frames_size * 2 : 1024;
+        if (!(frames = realloc(frames, frames_size * sizeof(*frames))))
+            tnomem();
+    }
+    f = &frames[sp++];
+    f->t = t;
+    f->r = NULL;
+    f->src = NULL;
+    f->slot = NULL;
+    f->depth = depth;
+    f->n = 0;
+    return f;
+}
+
+static struct sterm_t ** mfind(struct memo * m, const struct sterm_t * key, unsigned int depth, unsigned int shift) {
+    unsigned int i;
+    if (m->count * 2 >= m->size) {
+        struct entry * old = m->t;
+        unsigned int n = m->size;
+        m->size = m->size ? m->size * 2 : 256;
+        if (!(m->t = calloc(m->size, sizeof(*m->t))))
+            tnomem();
+        m->count = 0;
+        for (i = 0; i < n; i++)
+            if (old[i].gen == m->gen)
+                *mfind(m, old[i].key, old[i].depth, old[i].shift) = old[i].value;
+        free(old);
+    }
+    i = (((unsigned long) key >> 4) * 0x9E3779B1UL + depth + shift * 0x85EBCA6BUL) & (m->size - 1);
+    while (m->t[i].gen == m->gen) {
+        if (m->t[i].key == key && m->t[i].depth == depth && m->t[i].shift == shift)
+            return &m->t[i].value;
+        i = (i + 1) & (m->size - 1);
+    }
+    m->t[i].key = key;
+    m->t[i].depth = depth;
+    m->t[i].shift = shift;
+    m->t[i].gen = m->gen;
+    m->t[i].value = NULL;
+    m->count++;
+    return &m->t[i].value;
+}
+
+/* Rebuilds t with shift added to every index pointing above depth binders, or
+ * with s put in place of index depth and the gap left by its binder closed if s
+ * is given. Only the nodes above the indices that change are rebuilt, each once. */
+static struct sterm_t * swalk(struct sterm_t * t, unsigned int depth, unsigned int shift, struct sterm_t * s) {
+    struct memo * m = s ? &subst_memo : &shift_memo;
+    unsigned int base = sp;
+    struct sterm_t * r;
+    for (;;) {
+        if ((!s && !shift) || t->loose <= depth)
+            r = sref(t);
+        else if (t->type == tindex) {
+            if (!s)
+                r = sleaf(tindex, 0, t->data.index + shift);
+            else if (t->data.index == depth)
+                r = sshift(s, depth, 0);
+            else
+                r = sleaf(tindex, 0, t->data.index - 1);
+        } else if ((r = *mfind(m, t, depth, shift)))
+            r = sref(r);
+        else {
+            spush(t, depth);
+            if (t->type == tlambda) {
+                t = t->data.lambda_t.body;
+                depth++;
+            } else
+                t = t->data.app_t.left;
+            continue;
+        }
+        /* r is done: hand it to the frame waiting for it. */
+        for (;;) {
+            struct sterm_t * left;
+            if (sp == base)
+                return r;
+            t = frames[sp - 1].t;
+            depth = frames[sp - 1].depth;
+            if (t->type == tapp && !frames[sp - 1].n) {
+                frames[sp - 1].n = 1;
+                frames[sp - 1].r = r;
+                t = t->data.app_t.right;
+                break;
+            }
+            left = frames[--sp].r;
+            r = t->type == tlambda ? slambda(t->data.lambda_t.var, r) : sapp(left, r);
+            *mfind(m, t, depth, shift) = r;
+        }
+    }
+}
+
+/* Adds shift to every index of t that points above cutoff binders. */
+static struct sterm_t * sshift(struct sterm_t * t, unsigned int shift, unsigned int cutoff) {
+    return swalk(t, cutoff, shift, NULL);
+}
+
+/* Replaces index depth in t with s and closes the gap left by the binder. */
+static struct sterm_t * ssubst(struct sterm_t * t, unsigned int depth, struct sterm_t * s) {
+    return swalk(t, depth, 0, s);
+}
+
+static struct sterm_t * sbeta(struct sterm_t * lambda_t, struct sterm_t * s) {
+    struct sterm_t * r;
+    STAT(betas);
+    subst_memo.gen++;
+    subst_memo.count = 0;
+    shift_memo.gen++;
+    shift_memo.count = 0;
+    r = ssubst(lambda_t->data.lambda_t.body, 0, s);
+    return r;
+}
+
+static struct sterm_t * sbname(struct sterm_t * t) {
+    struct sterm_t ** args = NULL, * r;
+    unsigned int nargs = 0, size = 0;
+    for (;;) {
+        if (t->type == tapp) {
+            if (nargs == size) {
+                size = size ? size * 2 : 64;
+                if (!(args = realloc(args, size * sizeof(*args))))
+                    tnomem();
+            }
+            args[nargs++] = sref(t->data.app_t.right);
+            r = sref(t->data.app_t.left);
+        } else if (t->type == tlambda && nargs && tspend()) {
+            r = sbeta(t, args[--nargs]);
+            srelease(args[nargs]);
+        } else
+            break;
+        srelease(t);
+        t = r;
+    }
+    while (nargs)
+        t = sapp(t, args[--nargs]);
+    free(args);
+    return t;
+}
+
+/* Reduces the right operand of an application before the left one, and both
+ * before contracting it. A frame waits for its right operand with n = 0 and for
+ * its left one with n = 1. Once the head turns out to be a variable, or the
+ * budget is spent, nothing more is reduced, and the frames are only put back
+ * together. */
+static struct sterm_t * sbvalue(struct sterm_t * t) {
+    unsigned int base = sp;
+    bool halt = false;
+    for (;;) {
+        while (!halt && t->type == tapp) {
+            struct sterm_t * left = t->data.app_t.left, * right = t->data.app_t.right, * r;
+            if (right->type == tapp) {
+                spush(t, 0);
+                t = sref(right);
+            } else if (left->type == tlambda) {
+                if (!tspend()) {
+                    halt = true;
+                    continue;
+                }
+                r = sbeta(left, right);
+                srelease(t);
+                t = r;
+            } else if (left->type == tapp) {
+                spush(t, 0)->n = 1;
+                t = sref(left);
+            } else
+                halt = true;
+        }
+        if (sp == base)
+            return t;
+        {
+            struct sterm_t * app = frames[--sp].t;
+            if (frames[sp].n)
+                t = sapp(t, sref(app->data.app_t.right));
+            else
+                t = sapp(sref(app->data.app_t.left), t);
+            srelease(app);
+        }
+    }
+}
+
+/* Normalizes the operands of an application before contracting it, and the
+ * contractum again after that. Once the budget is spent the rest is only put
+ * back together. */
+static struct sterm_t * sdeep(struct sterm_t * t) {
+    unsigned int base = sp;
+    struct sterm_t * r;
+    for (;;) {
+        if (t->type == tlambda || t->type == tapp) {
+            spush(t, 0);
+            t = sref(t->type == tlambda ? t->data.lambda_t.body : t->data.app_t.left);
+            continue;
+        }
+        r = t;
+        /* r is normal: hand it to the frame waiting for it. */
+        for (;;) {
+            struct sterm_t * left;
+            if (sp == base)
+                return r;
+            t = frames[sp - 1].t;
+            if (t->type == tapp && !frames[sp - 1].n) {
+                frames[sp - 1].n = 1;
+                frames[sp - 1].r = r;
+                t = sref(t->data.app_t.right);
+                break;
+            }
+            left = frames[--sp].r;
+            if (t->type == tlambda) {
+                r = slambda(t->data.lambda_t.var, r);
+                srelease(t);
+                continue;
+            }
+            r = sapp(left, r);
+            srelease(t);
+            if (left->type == tlambda && tresult == rnormal) {
+                t = sbname(r);
+                if (tresult == rnormal)
+                    break;
+                r = t;
+            }
+        }
+    }
+}
+
+static struct sterm_t * sfrom(const struct term_t * t) {
+    unsigned int base = sp;
+    struct sterm_t * r;
+    for (;;) {
+        switch (t->type) {
+            case tlambda:
+            case tapp: {
+                    spush(NULL, 0)->src = t;
+                    t = t->type == tlambda ? t->data.lambda_t.body : t->data.app_t.left;
+                    continue;
+                }
+            case tvariabl:
+                r = sleaf(tvariabl, t->data.var, 0);
+                break;
+            case tindex:
+                r = sleaf(tindex, 0, t->data.index);
+                break;
+            default:
+                abort();
+        }
+        for (;;) {
+            struct sterm_t * left;
+            if (sp == base)
+                return r;
+            t = frames[sp - 1].src;
+            if (t->type == tapp && !frames[sp - 1].n) {
+                frames[sp - 1].n = 1;
+                frames[sp - 1].r = r;
+                t = t->data.app_t.right;
+                break;
+            }
+            left = frames[--sp].r;
+            r = t->type == tlambda ? slambda(t->data.lambda_t.var, r) : sapp(left, r);
+        }
+    }
+}
+
+static struct term_t * sto(struct sterm_t * t) {
+    unsigned int base = sp;
+    struct term_t * ret, ** slot = &ret, * p;
+    for (;;) {
+        *slot = p = palloc();
+        switch ((p->type = t->type)) {
+            case tlambda: {
+                    p->data.lambda_t.var = t->data.lambda_t.var;
+                    t = t->data.lambda_t.body;
+                    slot = &p->data.lambda_t.body;
+                    continue;
+                }
+            case tapp: {
+                    spush(t->data.app_t.left, 0)->slot = &p->data.app_t.left;
+                    t = t->data.app_t.right;
+                    slot = &p->data.app_t.right;
+                    continue;
+                }
+            case tvariabl:
+                p->data.var = t->data.var;
+                break;
+            case tindex:
+                p->data.index = t->data.index;
+                break;
+            default:
+                abort();
+        }
+        if (sp == base)
+            return ret;
+        t = frames[--sp].t;
+        slot = frames[sp].slot;
+    }
+}
+
+/* Returns NULL if the term has an integer too large for its numeral. */
+static struct sterm_t * simport(struct term_t ** ppterm) {
+    struct sterm_t * s;
+    if (!tchurch(*ppterm, NUMERAL_MAX))
+        return NULL;
+    tdbruijn(*ppterm);
+    s = sfrom(*ppterm);
+    tfparse(*ppterm);
+    return s;
+}
+
+static void sexport(struct term_t ** ppterm, struct sterm_t * s) {
+    *ppterm = sto(s);
+    srelease(s);
+    tnamed(*ppterm);
+}
+
+/* Gives back the nodes, the tables and the stack of the calling thread, along
+ * with whatever an evaluation that was cut short left in them. */
+void shclear(void) {
+    struct chunk * c;
+    while ((c = chunks)) {
+        chunks = c->next;
+        free(c);
+    }
+    free_nodes = NULL;
+    free(table);
+    table = NULL;
+    buckets = count = 0;
+    free(subst_memo.t);
+    free(shift_memo.t);
+    memset(&subst_memo, 0, sizeof(subst_memo));
+    memset(&shift_memo, 0, sizeof(shift_memo));
+    free(frames);
+    frames = NULL;
+    sp = frames_size = 0;
+}
+
+void shevalbname(struct term_t ** ppterm) {
+    struct sterm_t * s;
+    tresult = rnormal;
+    if ((s = simport(ppterm)))
+        sexport(ppterm, sbname(s));
+}
+
+void shevalbvalue(struct term_t ** ppterm) {
+    struct sterm_t * s;
+    tresult = rnormal;
+    if ((s = simport(ppterm)))
+        sexport(ppterm, sbvalue(s));
+}
+
+void shevaldeep(struct term_t ** ppterm) {
+    struct sterm_t * s;
+    tresult = rnormal;
+    if ((s = simport(ppterm)))
+        sexport(ppterm, sdeep(s));
+}
@@ -0,0 +1,82 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lambda.h"
+
+#define BUFFER_SIZE 65536
+
+/* Opens the named file, or standard input if name is NULL. Regular files are
+ * mapped into memory; anything else is read in blocks of BUFFER_SIZE bytes. */
+struct source * sopen(const char * name) {
+    struct source * src = calloc(1, sizeof(*src));
+    struct stat st;
+    if (!src)
+        tnomem();
+    src->name = name ? name : "-";
+    src->fd = name ? open(name, O_RDONLY) : STDIN_FILENO;
+    if (src->fd < 0 || fstat(src->fd, &st) < 0) {
+        sclose(src);
+        return NULL;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        src->length = st.st_size;
+        src->map = mmap(NULL, src->length, PROT_READ, MAP_PRIVATE, src->fd, 0);
+        if (src->map != MAP_FAILED) {
+            posix_madvise(src->map, src->length, POSIX_MADV_SEQUENTIAL);
+            src->p = src->map;
+            src->end = src->p + src->length;
+            return src;
+        }
+        src->map = NULL;
+    }
+    if (!(src->buf = malloc(BUFFER_SIZE)))
+        tnomem();
+    return src;
+}
+
+/* Refills the buffer once the parser has consumed it. A read returns as soon as
+ * some input is available, so a terminal is served one line at a time. */
+bool sfill(struct source * src) {
+    ssize_t n;
+    if (!src->buf)
+        return false;
+    while ((n = read(src->fd, src->buf, BUFFER_SIZE)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return false;
+    src->p = src->buf;
+    src->end = src->buf + n;
+    return true;
+}
+
+void sclose(struct source * src) {
+    if (src->map)
+        munmap(src->map, src->length);
+    if (src->fd > STDIN_FILENO)
+        close(src->fd);
+    free(src->buf);
+    free(src);
+}
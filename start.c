@@ -17,8 +17,18 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include "lambda.h"
 
+static void (*eval)(struct term_t **) = evaldeep;
+static int binary = 0, plain = 0, stats = 0, streaming = 0, optimize = 0, strict = 0;
+static unsigned long fuel = 0, ms = 0;
+
+#define MEMO_MB 64
+#define MAX_THREADS 1024
+
 static usage(void) {
     return puts(
         "Lambda calculus interpreter.\n"
@@ -26,20 +36,113 @@ static usage(void) {
         "\n"
         "  -n    Use call-by-name evaluation.\n"
         "  -v    Use call-by-value evaluation.\n"
-        "  -h    Display this help message."
+        "  -l    Use call-by-need evaluation.\n"
+        "  -d    Evaluate on De Bruijn indices instead of names.\n"
+        "  -g    Evaluate on hash-consed De Bruijn terms sharing subterms.\n"
+        "  -k    Evaluate on an abstract machine (Krivine, or CEK with -v).\n"
+        "  -c    Normalize on a compact array of 32-bit nodes.\n"
+        "  -i    Normalize by optimal reduction on interaction nets.\n"
+        "  -a    Normalize with the definitions compiled to native code by $CC (gcc)\n"
+        "        when a term first uses one, and the rest of the term interpreted.\n"
+        "  -j N  Evaluate N terms at a time on as many threads.\n"
+        "  -p N  Normalize big independent subterms on N threads.\n"
+        "  -b    Read terms in binary lambda calculus.\n"
+        "  -B    Write results in binary lambda calculus.\n"
+        "  -x    Write results in the syntax terms are read in.\n"
+        "  -e    Write normal forms head first as they are found (default evaluator).\n"
+        "  -O    Simplify terms before evaluating them: eta-reduce them and contract\n"
+        "        redexes using their variable once or not at all.\n"
+        "  -s    Print evaluation statistics of each term to stderr.\n"
+        "  -F N  Stop evaluating a term after N beta steps.\n"
+        "  -T N  Stop evaluating a term after N milliseconds.\n"
+        "  -P F  Load the definitions of a prelude text or image.\n"
+        "  -S F  Save the definitions loaded so far to an image and exit.\n"
+        "  -m F  Cache normal forms of closed redexes in file F across runs.\n"
+        "  -M N  Cache at most N megabytes of normal forms (64 with -m).\n"
+        "  -r F  Write the work done by each lambda of the input to F, busiest first.\n"
+        "  -R F  Write the beta steps of each lambda of the input to F as folded stacks.\n"
+        "  -h    Display this help message.\n"
+        "\n"
+        "Terms are read from the given file, or from standard input. A term ends at the\n"
+        "end of a line outside of parentheses, and a line holding just a dot ends the input.\n"
+        "A line [name] = term defines a name, which later terms can use as [name].\n"
+        "#n is a native integer standing for its Church numeral, and #add, #sub, #mul,\n"
+        "#pow, #eq, #lt and #le are primitives on integers and numerals. -l, -g, -k, -c, -i\n"
+        "and -a only see the numerals and the terms of the primitives, so they print a\n"
+        "numeral where the others print #n, and overflow on integers above 4194304.\n"
+        "A term that runs out of steps or time, or whose native arithmetic overflows, is\n"
+        "printed as far as it got, after a line saying so; with -B that line goes to stderr,\n"
+        "and -b can resume the result. With -e the line comes after the term instead.\n"
+        "Only the -n, -v and default evaluators charge their work to lambdas for -r and -R."
     );
 }
 
+/* Reads the argument of option o as a decimal number from min to max, or says
+ * what is wrong with it. */
+static bool number(char o, const char * s, unsigned long min, unsigned long max, unsigned long * n) {
+    char * end;
+    errno = 0;
+    if (s && *s >= '0' && *s <= '9') {
+        *n = strtoul(s, &end, 10);
+        if (!*end && !errno && *n >= min && *n <= max)
+            return true;
+    }
+    fprintf(stderr, "-%c needs a number from %lu to %lu.\n", o, min, max);
+    return false;
+}
+
+static void run(struct term_t * t, FILE * out) {
+    if (!t) {
+        fprintf(out, "%s\nParse error\n", terror);
+        return;
+    }
+    if (optimize)
+        toptimize(&t, strict);
+    tlimit(fuel, ms);
+    if (streaming) {
+        tstream(t, plain, out);
+        putc('\n', out);
+    } else
+        eval(&t);
+    if (tresult != rnormal)
+        fputs(tresult == rfuel ? "Out of fuel.\n" : tresult == rtime ? "Out of time.\n" : "Arithmetic overflow.\n",
+              binary ? stderr : out);
+    if (stats)
+        fprintf(stderr, "betas %lu, substitutions %lu, copies %lu, renames %lu, walks %lu, "
+                "allocs %lu, frees %lu, peak nodes %lu, spine %lu, hits %lu, misses %lu, etas %lu, "
+                "inlines %lu, drops %lu\n", tstats.betas, tstats.substs, tstats.copies, tstats.renames,
+                tstats.walks, tstats.allocs, tstats.frees, tstats.peak, tstats.spine, tstats.hits,
+                tstats.misses, tstats.etas, tstats.inlines, tstats.drops);
+    if (streaming)
+        return;
+    if (binary)
+        tbwrite(t, out);
+    else {
+        (plain ? tswrite : tdparse)(t, out);
+        putc('\n', out);
+    }
+#ifdef PALLOC_MALLOC
+    /* treset() has no slabs to drop the nodes with. */
+    tfparse(t);
+#endif
+}
+
 main(argc, argv) int argc; char ** argv; {
-    void (*eval)(struct term_t **) = evaldeep;
-    char buf[STRING_MAX], * arg;
+    bool (*read)(struct source *, struct term_t **) = tsparse;
+    char * arg, * name = NULL, * image = NULL, * memo = NULL, * profile = NULL;
+    struct source * src;
     struct term_t * t;
-    
-    substart();
+    int debruijn = 0, shared = 0, machine = 0, compact = 0, nets = 0, native = 0, jobs = 1, megs = -1;
+    unsigned long n;
+    bool folded = false;
     
     while (*++argv) {
         arg = *argv;
-        if (arg[0] != '-' || arg[1] == 0)
+        if (arg[0] != '-') {
+            name = arg;
+            continue;
+        }
+        if (arg[1] == 0)
             continue;
         switch (arg[1]) {
             case 'h':
@@ -51,21 +154,160 @@ main(argc, argv) int argc; char ** argv; {
             case 'n':
                 eval = evalbname;
                 continue;
+            case 'l':
+                eval = evalbneed;
+                continue;
+            case 'd':
+                debruijn = 1;
+                continue;
+            case 'g':
+                shared = 1;
+                continue;
+            case 'k':
+                machine = 1;
+                continue;
+            case 'c':
+                compact = 1;
+                continue;
+            case 'i':
+                nets = 1;
+                continue;
+            case 'a':
+                native = 1;
+                continue;
+            case 'b':
+                read = tbparse;
+                continue;
+            case 'B':
+                binary = 1;
+                continue;
+            case 'x':
+                plain = 1;
+                continue;
+            case 'e':
+                streaming = 1;
+                continue;
+            case 'O':
+                optimize = 1;
+                continue;
+            case 's':
+#ifdef NSTATS
+                fputs("Statistics were compiled out.\n", stderr);
+#endif
+                stats = 1;
+                continue;
+            case 'j':
+                if (!number('j', arg[2] ? arg + 2 : argv[1] ? *++argv : NULL, 1, MAX_THREADS, &n))
+                    return 1;
+                jobs = n;
+                continue;
+            case 'F':
+                if (!number('F', arg[2] ? arg + 2 : argv[1] ? *++argv : NULL, 0, ULONG_MAX, &fuel))
+                    return 1;
+                continue;
+            case 'T':
+                if (!number('T', arg[2] ? arg + 2 : argv[1] ? *++argv : NULL, 0, ULONG_MAX, &ms))
+                    return 1;
+                continue;
+            case 'P':
+                if (!arg[2] && !argv[1])
+                    continue;
+                arg = arg[2] ? arg + 2 : *++argv;
+                if (!tprelude(arg)) {
+                    perror(arg);
+                    return 1;
+                }
+                continue;
+            case 'S':
+                if (arg[2])
+                    image = arg + 2;
+                else if (argv[1])
+                    image = *++argv;
+                continue;
+            case 'm':
+                if (arg[2])
+                    memo = arg + 2;
+                else if (argv[1])
+                    memo = *++argv;
+                continue;
+            case 'M':
+                if (!number('M', arg[2] ? arg + 2 : argv[1] ? *++argv : NULL, 0, INT_MAX, &n))
+                    return 1;
+                megs = n;
+                continue;
+            case 'r':
+            case 'R':
+                folded = arg[1] == 'R';
+                if (arg[2])
+                    profile = arg + 2;
+                else if (argv[1])
+                    profile = *++argv;
+                continue;
+            case 'p':
+                if (!number('p', arg[2] ? arg + 2 : argv[1] ? *++argv : NULL, 1, MAX_THREADS, &n))
+                    return 1;
+                tparallel(n);
+                continue;
             default:
                 ;
         }
     }
     
-    for (;;) {
-        if (!fgets(buf, STRING_MAX, stdin) || strcmp(buf, ".\n") == 0)
+    strict = eval == evalbvalue;
+    uprofiling = profile != NULL;
+    if (eval != evaldeep || binary || native || nets || compact || machine || shared || debruijn)
+        streaming = 0;
+    
+    if (eval == evalbneed)
+        ;
+    else if (native && eval == evaldeep)
+        eval = aevaldeep;
+    else if (nets && eval == evaldeep)
+        eval = ievaldeep;
+    else if (compact && eval == evaldeep)
+        eval = cevaldeep;
+    else if (machine)
+        eval = eval == evalbname ? kevalbname : eval == evalbvalue ? kevalbvalue : kevaldeep;
+    else if (shared)
+        eval = eval == evalbname ? shevalbname : eval == evalbvalue ? shevalbvalue : shevaldeep;
+    else if (debruijn)
+        eval = eval == evalbname ? dbevalbname : eval == evalbvalue ? dbevalbvalue : dbevaldeep;
+    
+    if (image) {
+        if (tsnapshot(image))
             return 0;
-        if (!(t = tparse(buf))) {
-            puts("Parse error");
-            continue;
+        perror(image);
+        return 1;
+    }
+    
+    if (megs < 0)
+        megs = memo ? MEMO_MB : 0;
+    mlimit((size_t) megs << 20);
+    if (memo && megs && !mload(memo))
+        fprintf(stderr, "%s: Not a normal form cache.\n", memo);
+    
+    if (!(src = sopen(name))) {
+        perror(name);
+        return 1;
+    }
+    
+    if (jobs > 1)
+        batch(src, read, run, jobs);
+    else
+        while (read(src, &t)) {
+            run(t, stdout);
+            treset();
         }
-        eval(&t);
-        tdparse(t, stdout);
-        tfparse(t);
-        putchar('\n');
+    
+    sclose(src);
+    if (memo && megs && !msave(memo)) {
+        perror(memo);
+        return 1;
+    }
+    uflush();
+    if (profile && !ureport(profile, folded)) {
+        perror(profile);
+        return 1;
     }
+    return 0;
 }
@@ -0,0 +1,259 @@
+/* LambdaCalculus
+ * Copyright (C) Kamila Palaiologos Szewczyk, 2019.
+ * License: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lambda.h"
+
+/* Normalizes terms a million levels deep with every strategy, each in a child
+ * process of its own with the default C stack, and checks what comes back. Every
+ * traversal runs on an explicit stack, so none of them may run out of C stack at
+ * any depth: a crash is a regression. The result is also copied, written and
+ * freed, which walks it the same way. Prints a line per run and fails if any run
+ * did. */
+
+/* skip has a bit for every strategy left out. */
+struct workload {
+    const char * name;
+    void (*gen)(FILE *, unsigned int);
+    void (*expect)(FILE *, unsigned int, int);
+    unsigned int skip;
+};
+
+/* A strategy with a limit runs at most that deep. */
+struct strategy {
+    const char * name;
+    void (*eval)(struct term_t **);
+    unsigned int limit;
+};
+
+/* The strategies that stop at weak head normal form come first. */
+enum {
+    sname,
+    svalue,
+    sneed,
+    sdbname,
+    sdbvalue,
+    sshname,
+    sshvalue,
+    skname,
+    skvalue,
+    sdeep,
+    sstream,
+    sdebruijn,
+    sshared,
+    smachine,
+    scompact,
+    snet,
+    scompiled
+};
+
+static void repeat(FILE *, const char *, unsigned int);
+static void deep(FILE *, unsigned int);
+static void deep_nf(FILE *, unsigned int, int);
+static void spine(FILE *, unsigned int);
+static void spine_nf(FILE *, unsigned int, int);
+static void nested(FILE *, unsigned int);
+static void nested_nf(FILE *, unsigned int, int);
+static void under(FILE *, unsigned int);
+static void under_nf(FILE *, unsigned int, int);
+static void erased(FILE *, unsigned int);
+static void erased_nf(FILE *, unsigned int, int);
+static void stream(struct term_t **);
+static int check(const struct workload *, unsigned int, int, unsigned int);
+
+/* Call-by-name on either representation, and so the streamed writer, copies the
+ * whole argument left at every step of deep, which takes time quadratic in the
+ * depth whatever the stack. */
+static const struct workload workloads[] = {
+    { "deep", deep, deep_nf, 1 << sname | 1 << sdbname | 1 << sstream },
+    { "spine", spine, spine_nf, 0 },
+    { "nested", nested, nested_nf, 0 },
+    { "under", under, under_nf, 0 },
+    { "erased", erased, erased_nf, 0 }
+};
+
+static const struct strategy strategies[] = {
+    { "name", evalbname, 0 },
+    { "value", evalbvalue, 0 },
+    { "need", evalbneed, 0 },
+    { "debruijn-name", dbevalbname, 0 },
+    { "debruijn-value", dbevalbvalue, 0 },
+    { "shared-name", shevalbname, 0 },
+    { "shared-value", shevalbvalue, 0 },
+    { "machine-name", kevalbname, 0 },
+    { "machine-value", kevalbvalue, 0 },
+    { "deep", evaldeep, 0 },
+    { "stream", stream, 0 },
+    { "debruijn", dbevaldeep, 0 },
+    { "shared", shevaldeep, 0 },
+    { "machine", kevaldeep, 0 },
+    { "compact", cevaldeep, 0 },
+    { "net", ievaldeep, 0 },
+    { "compiled", aevaldeep, 0 }
+};
+
+static void repeat(FILE * f, const char * s, unsigned int n) {
+    while (n--)
+        fputs(s, f);
+}
+
+/* n identities applied inside each other. */
+static void deep(FILE * f, unsigned int n) {
+    repeat(f, "(\\x x) (", n);
+    putc('y', f);
+    repeat(f, ")", n);
+}
+
+static void deep_nf(FILE * f, unsigned int n, int s) {
+    (void) n;
+    (void) s;
+    putc('y', f);
+}
+
+/* An identity applied to a variable and n arguments. */
+static void spine(FILE * f, unsigned int n) {
+    fputs("(\\x x) v", f);
+    repeat(f, " a", n);
+}
+
+static void spine_nf(FILE * f, unsigned int n, int s) {
+    (void) s;
+    repeat(f, "@ (", n);
+    putc('v', f);
+    repeat(f, ", a)", n);
+}
+
+/* n lambdas inside each other, with a redex at the bottom. */
+static void nested(FILE * f, unsigned int n) {
+    repeat(f, "\\x ", n);
+    fputs("(\\y y) x", f);
+}
+
+static void nested_nf(FILE * f, unsigned int n, int s) {
+    repeat(f, "Lam (x, ", n);
+    fputs(s >= sdeep ? "x" : "@ (Lam (y, y), x)", f);
+    repeat(f, ")", n);
+}
+
+/* A substitution reaching through n lambdas. */
+static void under(FILE * f, unsigned int n) {
+    fputs("(\\y ", f);
+    repeat(f, "\\x ", n);
+    fputs("x y) z", f);
+}
+
+static void under_nf(FILE * f, unsigned int n, int s) {
+    (void) s;
+    repeat(f, "Lam (x, ", n);
+    fputs("@ (x, z)", f);
+    repeat(f, ")", n);
+}
+
+/* A redex under n lambdas dropping an argument that has no normal form, which a
+ * strict streamed head used to normalize first. */
+static void erased(FILE * f, unsigned int n) {
+    repeat(f, "\\v ", n);
+    fputs("(\\x (\\y z) (x x)) (\\w w w)", f);
+}
+
+static void erased_nf(FILE * f, unsigned int n, int s) {
+    repeat(f, "Lam (v, ", n);
+    fputs(s >= sdeep ? "z" : "@ (Lam (x, @ (Lam (y, z), @ (x, x))), Lam (w, @ (w, w)))", f);
+    repeat(f, ")", n);
+}
+
+/* Writes the normal form the way -e does and reads it back in. */
+static void stream(struct term_t ** t) {
+    char * text;
+    size_t length;
+    FILE * f;
+    if (!(f = open_memstream(&text, &length)))
+        tnomem();
+    tstream(*t, true, f);
+    fclose(f);
+    *t = tparse(text);
+    free(text);
+}
+
+static int check(const struct workload * w, unsigned int n, int s, unsigned int timeout) {
+    int status;
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        struct term_t * t, * copy;
+        char * text, * expected;
+        size_t length, expected_length;
+        FILE * f;
+        alarm(timeout);
+        if (!(f = open_memstream(&text, &length)))
+            tnomem();
+        w->gen(f, n);
+        fclose(f);
+        t = tparse(text);
+        free(text);
+        strategies[s].eval(&t);
+        copy = tcparse(t);
+        tfparse(t);
+        if (!(f = open_memstream(&text, &length)))
+            tnomem();
+        tdparse(copy, f);
+        fclose(f);
+        tfparse(copy);
+        if (!(f = open_memstream(&expected, &expected_length)))
+            tnomem();
+        w->expect(f, n, s);
+        fclose(f);
+        exit(length == expected_length && !memcmp(text, expected, length) ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    printf("%s\t%u\t%s\t%s\n", w->name, n, strategies[s].name,
+           WIFEXITED(status) ? WEXITSTATUS(status) ? "wrong" : "ok"
+           : WTERMSIG(status) == SIGALRM ? "timeout" : "crash");
+    return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+int main(int argc, char ** argv) {
+    unsigned int depth = 1000000, timeout = 60, i, s;
+    int ok = 1;
+    (void) argc;
+    
+    while (*++argv) {
+        if (strcmp(*argv, "-n") == 0 && argv[1])
+            depth = strtoul(*++argv, NULL, 10);
+        else if (strcmp(*argv, "-t") == 0 && argv[1])
+            timeout = strtoul(*++argv, NULL, 10);
+    }
+    
+    for (i = 0; i < sizeof(workloads) / sizeof(*workloads); i++)
+        for (s = 0; s < sizeof(strategies) / sizeof(*strategies); s++) {
+            unsigned int n = strategies[s].limit && strategies[s].limit < depth ? strategies[s].limit : depth;
+            if (!(workloads[i].skip >> s & 1))
+                ok &= check(&workloads[i], n, s, timeout);
+        }
+    return !ok;
+}